@@ -6,194 +6,419 @@
 #include <chrono>
 #include <gsl/gsl_util>
 #include <list>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <unordered_set>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 using namespace std;
 using namespace std::chrono_literals;
 using namespace chess;
 using namespace algorithm;
 
-void algorithm::AnalysedPosition::append_calculation(Square start)
-{
-	const auto moved = pos().at(start);
-	const auto mvd_t = moved.type();
-	const auto mvd_a = moved.almnt();
-	auto& moves_out = m_moves[as_index(mvd_a)];
-	auto& ctrl_out = m_control[as_index(mvd_a)];
+namespace {
+	//squares controlled by the piece on start
+	Bitboard control_set(const Position& pos, Square start)
+	{
+		const Piece moved = pos.at(start);
+		const Bitboard own = pos.pieces(moved.almnt());
+		const Bitboard occupied = pos.occupied();
+
+		switch (moved.type()) {
+			case Piece::Type::Empty: return 0;
+			case Piece::Type::Pawn: return pawn_attacks(moved.almnt(), start); //pawns control their diagonals even when defending
+			case Piece::Type::Knight: return knight_attacks(start) & ~own;
+			case Piece::Type::King: return king_attacks(start) & ~own;
+			case Piece::Type::Queen: return queen_attacks(start, occupied) & ~own;
+			case Piece::Type::Rook: return rook_attacks(start, occupied) & ~own;
+			case Piece::Type::Bishop: return bishop_attacks(start, occupied) & ~own;
+		}
+		return 0;
+	}
 
-	//TODO: use [=] or [&] in lambdas?
-	const auto add_move = [&](Square end) {moves_out.emplace_back(start, end);};
-	const auto add_promo = [&](Square end) {for (auto t : MoveRecord::promo_types) moves_out.emplace_back(start, end, t);};
-	const auto add_ctrl = [&](Square end) {ctrl_out.set(end.file(), end.rank(), ctrl_out.get(end.file(), end.rank()) + 1);};
+	//pseudo-legal destinations of the piece on start, given the squares it controls
+	Bitboard move_targets(const Position& pos, Square start, Bitboard ctrl)
+	{
+		const Piece moved = pos.at(start);
+		if (moved.type() != Piece::Type::Pawn) return ctrl;
+
+		const Almnt a = moved.almnt();
+		const Bitboard occupied = pos.occupied();
+		Bitboard enemy = pos.pieces(!a);
+		if (pos.en_passant_target() && pos.to_move() == a) enemy |= square_bb(*pos.en_passant_target());
+
+		//a push is blocked by a piece on it or on the square it passes through
+		const Bitboard others = occupied ^ square_bb(start);
+		const Bitboard passed = (a == Almnt::White ? others << 8 : others >> 8);
+		return (ctrl & enemy) | (pawn_pushes(a, start) & ~(occupied | passed));
+	}
 
-	typedef array<pair<int, int>, 4> mv_tmpl;
-	constexpr mv_tmpl knight_1 {make_pair(1, 2), make_pair(-1, 2), make_pair(1, -2), make_pair(-1, -2)};
-	constexpr mv_tmpl knight_2 {make_pair(2, 1), make_pair(2, -1), make_pair(-2, 1), make_pair(-2, -1)};
-	constexpr mv_tmpl orthogonal {make_pair(1,0), make_pair(0,1), make_pair(-1,0), make_pair(0,-1)};
-	constexpr mv_tmpl diagonal {make_pair(1,1), make_pair(1,-1), make_pair(-1,1), make_pair(-1,-1)};
-	
-	const auto apply_tmpl = [&](const mv_tmpl& tmpl, bool repeat)
+	inline bool promotes(const Position& pos, Square start)
 	{
-		for (const auto& p : tmpl) {
-			optional<Square> new_s = start;
-			do {
-				new_s = new_s->translate(p.first, p.second);
-				if (!new_s) break;
-				const auto capt_almnt = pos().at(*new_s).almnt_res();
-				if (capt_almnt != mvd_a) {
-					add_move(*new_s);
-					add_ctrl(*new_s);
-				}
-				if (capt_almnt != AlRes::None) break;
-			} while (repeat);
-		}
-	};
+		const Piece moved = pos.at(start);
+		return moved.type() == Piece::Type::Pawn && start.rank() == (moved.almnt() == Almnt::White ? 6 : 1);
+	}
 
-	const auto handle_pawn = [&]()
+	void append_targets(Square start, Bitboard targets, bool promo, MoveList& out)
 	{
-		array<int, 2> start_ranks {1, 6};
-		const int mvdir = (mvd_a == Almnt::White ? 1 : -1);
-		const bool dbl_mv = start.rank() == start_ranks[as_index(mvd_a)];
-		const bool promo = start.rank() == start_ranks[as_index(!mvd_a)];
-		for (int i = -1; i <= 1; i++) {
-			const auto new_s = start.translate(i,mvdir);
-			if (!new_s) continue;
-			const auto capt = pos().at(*new_s);
-			const auto capt_t = capt.type();
-			const auto capt_a = capt.almnt();
-			if (i != 0) {
-				add_ctrl(*new_s);
-				if (!(pos().en_passant_target() && *new_s == *pos().en_passant_target())
-					&& (capt_t == Piece::Type::Empty || capt_a == mvd_a)) continue; //capturing moves conditions
-			}
-			else if (capt.type() != Piece::Type::Empty) continue; //forward moves conditions
-			
-			if (promo) add_promo(*new_s);
-			else add_move(*new_s);
-			
-			if (dbl_mv && i == 0){ //double move
-				const Square dbl_sq = *start.translate(0, mvdir * 2); //translation always valid
-				if (pos().at(dbl_sq).type() == Piece::Type::Empty) add_move(dbl_sq);
-			}
+		while (targets) {
+			const Square end = all_squares[pop_lsb(targets)];
+			if (promo) for (auto t : MoveRecord::promo_types) out.emplace_back(start, end, t);
+			else out.emplace_back(start, end);
 		}
-	};
+	}
 
-	switch (mvd_t) {
-		case Piece::Type::Empty: break;
-		case Piece::Type::Pawn: handle_pawn(); break;
-		case Piece::Type::Knight: apply_tmpl(knight_1, false); apply_tmpl(knight_2, false); break;
-		case Piece::Type::King: apply_tmpl(orthogonal, false); apply_tmpl(diagonal, false); break;
-		case Piece::Type::Queen: apply_tmpl(orthogonal, true); apply_tmpl(diagonal, true); break;
-		case Piece::Type::Rook: apply_tmpl(orthogonal, true); break;
-		case Piece::Type::Bishop: apply_tmpl(diagonal, true); break;
+	//castling for the side to move, attacked(squares) tells whether the enemy attacks any of them
+	template <typename Attacked>
+	void append_castling(const Position& pos, Attacked attacked, MoveList& out)
+	{
+		const Almnt us = pos.to_move();
+		const Square start = (us == Almnt::White ? Square("e1") : Square("e8"));
+		for (Side side : {Side::Kingside, Side::Queenside}) {
+			if (!pos.can_castle(us, side)) continue;
+			const int mvdir = (side == Side::Kingside ? 1 : -1);
+			const int num_sqs = (side == Side::Kingside ? 2 : 3);
+			bool ok = true;
+			for (int i = 1; i <= num_sqs; i++) if (pos.at(all_squares[start.index() + i * mvdir]).type() != Piece::Type::Empty) ok = false;
+			const Bitboard king_path = square_bb(start) | square_bb(start.index() + mvdir) | square_bb(start.index() + 2 * mvdir);
+			if (ok && !attacked(king_path)) out.emplace_back(start, all_squares[start.index() + 2 * mvdir]);
+		}
 	}
 }
 
-void algorithm::AnalysedPosition::append_castling() //needs a cancastle check
+void algorithm::AnalysedBoard::add_control(Almnt a, Bitboard squares, int delta)
 {
-	//cerr << *this << endl;
-	typedef pair<Almnt, Side> castle_t;
-	constexpr array<castle_t, 4> castle_types {
-		make_pair(Almnt::White, Side::Kingside), make_pair(Almnt::White, Side::Queenside),
-		make_pair(Almnt::Black, Side::Kingside), make_pair(Almnt::Black, Side::Queenside)
-	};
+	auto& ctrl_out = m_control[as_index(a)];
+	assert(delta == 1 || delta == -1);
+	if (delta > 0) ctrl_out.add(squares);
+	else ctrl_out.sub(squares);
+}
+
+void algorithm::AnalysedBoard::append_calculation(Square start)
+{
+	add_control(pos().at(start).almnt(), control_set(pos(), start), 1);
+}
+
+//squares of the pieces whose moves or control can depend on the contents of the changed squares
+Bitboard algorithm::AnalysedBoard::dependants(Bitboard changed) const
+{
+	const auto& p = pos();
+	const Bitboard occupied = p.occupied();
+	const Bitboard orth = p.pieces(Piece::Type::Rook) | p.pieces(Piece::Type::Queen);
+	const Bitboard diag = p.pieces(Piece::Type::Bishop) | p.pieces(Piece::Type::Queen);
+	const Bitboard w_pawns = p.pieces(Almnt::White, Piece::Type::Pawn);
+	const Bitboard b_pawns = p.pieces(Almnt::Black, Piece::Type::Pawn);
+
+	Bitboard out = changed & occupied;
+	for (Bitboard b = changed; b;) {
+		const int index = pop_lsb(b);
+		const Square s = all_squares[index];
+		out |= rook_attacks(s, occupied) & orth;
+		out |= bishop_attacks(s, occupied) & diag;
+		out |= knight_attacks(s) & p.pieces(Piece::Type::Knight);
+		out |= king_attacks(s) & p.pieces(Piece::Type::King);
+		out |= pawn_attacks(Almnt::Black, s) & w_pawns; //white pawns capturing onto s
+		out |= pawn_attacks(Almnt::White, s) & b_pawns;
+		if (index >= 8) out |= square_bb(index - 8) & w_pawns; //pawns pushing through s
+		if (index < 56) out |= square_bb(index + 8) & b_pawns;
+		if (s.rank() == 3) out |= square_bb(index - 16) & w_pawns;
+		if (s.rank() == 4) out |= square_bb(index + 16) & b_pawns;
+	}
+	return out;
+}
 
-	for (const auto c : castle_types) {
-		if (!pos().can_castle(c.first, c.second)) continue;
-		const int mvdir = (c.second == Side::Kingside ? 1 : -1);
-		const int num_sqs = (c.second == Side::Kingside ? 2 : 3);
-		const auto start = Square(c.first == Almnt::White ? "e1" : "e8");
-		bool ok = true;
-		for (int i = 0; i < 3; i++) if (ctrl(!c.first, *start.translate(i * mvdir, 0)) > 0) ok = false;
-		for (int i = 1; i <= num_sqs; i++) if (pos().at(*start.translate(i * mvdir, 0)).type() != Piece::Type::Empty) ok = false;
-		if (ok) m_moves[as_index(c.first)].emplace_back(start, *start.translate(2 * mvdir, 0));
+//remove the control of the pieces on the given squares, the moves are generated afresh once the position has changed
+void algorithm::AnalysedBoard::remove_calculation(Bitboard squares)
+{
+	for (Bitboard b = squares; b;) {
+		const Square s = all_squares[pop_lsb(b)];
+		add_control(pos().at(s).almnt(), control_set(pos(), s), -1);
 	}
 }
 
-algorithm::AnalysedPosition::AnalysedPosition(const chess::Position& t_pos)
+void algorithm::AnalysedPosition::append_castling()
+{
+	const Almnt them = !pos().to_move();
+	::append_castling(pos(), [&](Bitboard squares) {return ctrl_count(them, squares) > 0;}, m_moves);
+}
+
+algorithm::AnalysedBoard::AnalysedBoard(const chess::Position& t_pos)
 	: m_position(t_pos)
 {
-	for (auto& v : m_moves) v.reserve(140);
-	for (Square s : all_squares) {
-		append_calculation(s);
-		const int index = (int) m_position.at(s).almnt();
-		if (m_position.at(s).type() == Piece::Type::King) m_king_sq[index] = s;
+	for (Bitboard b = m_position.occupied(); b;) append_calculation(all_squares[pop_lsb(b)]);
+}
+
+algorithm::AnalysedPosition::AnalysedPosition(const chess::Position& t_pos)
+	: m_board(t_pos)
+{
+	generate_moves();
+}
+
+algorithm::AnalysedPosition::AnalysedPosition(const AnalysedBoard& t_board)
+	: m_board(t_board)
+{
+	generate_moves();
+}
+
+namespace {
+	//every square whose contents change when mr is played or taken back, including old and new en passant targets
+	Bitboard changed_squares(MoveRecord mr, Piece::Type moved, optional<Square> ep_before)
+	{
+		const Square start = mr.initial();
+		const Square end = mr.final();
+		Bitboard changed = square_bb(start) | square_bb(end);
+		if (ep_before) changed |= square_bb(*ep_before);
+		if (moved == Piece::Type::Pawn && abs(static_cast<int>(end.rank()) - static_cast<int>(start.rank())) == 2) {
+			changed |= square_bb((start.index() + end.index()) / 2);
+		}
+		if (moved == Piece::Type::King && abs(static_cast<int>(end.file()) - static_cast<int>(start.file())) > 1) {
+			const bool kingside = end.file() > start.file(); //the rook jumps from its corner to the square the king passed over
+			changed |= square_bb(start.index() + (kingside ? 3 : -4)) | square_bb(start.index() + (kingside ? 1 : -1));
+		}
+		if (moved == Piece::Type::Pawn && ep_before && end == *ep_before) {
+			changed |= square_bb(end.file() + 8 * start.rank()); //the pawn taken en passant
+		}
+		return changed;
 	}
-	append_castling();
-	for (auto& v : m_moves) v.shrink_to_fit();
 }
 
-void algorithm::AnalysedPosition::advance_by(chess::MoveRecord mr) //en_passant?
+void algorithm::AnalysedBoard::advance_by(chess::MoveRecord mr)
 {
-	Move mv(pos(), mr);
-	assert(!(mv.is_en_passant() || mv.is_castling() || mv.is_promotion()));
+	make_move(mr);
+}
 
-	const Square start = mr.initial();
-	const Square end = mr.final();
-	auto info = get_occlusion(mr);
-	
-	const auto prune_moves = [&]() { //need white and black vector TODO
-		vector<MoveRecord> new_w;
-		vector<MoveRecord> new_b;
-		new_w.reserve(m_moves[0].size());
-		new_b.reserve(m_moves[1].size());
-		for (const MoveRecord m : m_moves[0]) {
-			bool keep = true;
-			const Square si {m.initial()};
-			const Square sf {m.final()};
-			if (si == start) keep = false; //cache m.initial()?
-			if (si == end) keep = false; //cull moves of captured piece
-			for (int i = 0; i < info.counts[0]; i++) if (si == info.squares[0][i]) keep = false;
-			if (pos().at(si).type() != Piece::Type::King) { //strip castling
-				if (si.file() == 4 && (sf.file() == 2 || sf.file() == 6)) {
-					keep = false;
-					continue;
-				}
-			}
-			if (keep) new_w.push_back(m);
-			else {
-				if (pos().at(si).type() != Piece::Type::Pawn || si.file() != sf.file()) { //is not pawn forward move
-					m_control[0].set(sf.file(), sf.rank(), m_control[0].get(sf.file(), sf.rank()) - 1);
-				}
-			}
+AnalysedBoard::Undo algorithm::AnalysedBoard::make_move(MoveRecord mr)
+{
+	Undo undo;
+	undo.control = m_control;
+	const Bitboard changed = changed_squares(mr, pos().at(mr.initial()).type(), pos().en_passant_target());
+	remove_calculation(dependants(changed));
+	undo.position = m_position.make_move(mr);
+	append_dependants(changed);
+	return undo;
+}
+
+//64 bytes of control are cheaper to copy back than the dependants are to recalculate
+void algorithm::AnalysedBoard::unmake_move(const Undo& undo)
+{
+	m_position.unmake_move(undo.position);
+	m_control = undo.control;
+}
+
+//second half of an incremental update, once the position has changed
+void algorithm::AnalysedBoard::append_dependants(Bitboard changed)
+{
+	for (Bitboard b = dependants(changed); b;) append_calculation(all_squares[pop_lsb(b)]);
+}
+
+void algorithm::AnalysedPosition::advance_by(chess::MoveRecord mr)
+{
+	make_move(mr);
+}
+
+//control is patched from the changed squares but the moves are generated afresh, as the side to move has changed:
+//patching them would mean keeping the other side's moves up to date on every move as well, which measured slower
+//than regenerating one legal list
+AnalysedPosition::Undo algorithm::AnalysedPosition::make_move(MoveRecord mr)
+{
+	Undo undo {m_board.make_move(mr), m_moves};
+	generate_moves();
+	return undo;
+}
+
+void algorithm::AnalysedPosition::unmake_move(const Undo& undo)
+{
+	m_board.unmake_move(undo.board);
+	m_moves = undo.moves;
+}
+
+void algorithm::AnalysedPosition::generate_moves()
+{
+	m_moves.clear();
+	const MoveClassifier classifier(pos(), false);
+	for (Bitboard b = pos().pieces(pos().to_move()); b;) {
+		const Square s = all_squares[pop_lsb(b)];
+		const Bitboard targets = classifier.legal_targets(s, move_targets(pos(), s, control_set(pos(), s)));
+		append_targets(s, targets, promotes(pos(), s), m_moves);
+	}
+	append_castling(); //the king's path is checked against the control maps
+}
+
+void algorithm::AnalysedPosition::order_moves()
+{
+	const MoveClassifier classifier(pos());
+	MoveRecord* const quiets = partition(m_moves.begin(), m_moves.end(), [&](MoveRecord m) {return classifier.capture(m);});
+	partition(quiets, m_moves.end(), [&](MoveRecord m) {return classifier.gives_check(m);});
+}
+
+namespace {
+	//own pieces that are the only blocker between the king on ksq and one of the snipers
+	Bitboard lone_blockers(const Position& pos, Square ksq, Bitboard snipers, Bitboard own)
+	{
+		Bitboard out = 0;
+		while (snipers) {
+			const Bitboard blockers = between_bb(ksq, all_squares[pop_lsb(snipers)]) & pos.occupied();
+			if (popcount(blockers) == 1) out |= blockers & own;
 		}
-		for (const MoveRecord m : m_moves[1]) {
-			bool keep = true;
-			const Square si {m.initial()};
-			const Square sf {m.final()};
-			if (si == start) keep = false;
-			if (si == end) keep = false; //cull moves of captured piece
-			for (int i = 0; i < info.counts[1]; i++) if (si == info.squares[1][i]) keep = false;
-			if (pos().at(si).type() != Piece::Type::King) { //strip castling
-				if (si.file() == 4 && (sf.file() == 2 || sf.file() == 6)) {
-					keep = false;
-					continue;
-				}
-			}
-			if (keep) new_b.push_back(m);
-			else {
-				if (pos().at(si).type() != Piece::Type::Pawn || si.file() != sf.file()) { //is not pawn forward move
-					m_control[1].set(sf.file(), sf.rank(), m_control[1].get(sf.file(), sf.rank()) - 1);
-				}
-			};
+		return out;
+	}
+}
+
+algorithm::MoveClassifier::MoveClassifier(const Position& t_pos, bool with_checks)
+	: m_position(&t_pos)
+{
+	const Almnt us = t_pos.to_move();
+	const Almnt them = !us;
+	const Bitboard occupied = t_pos.occupied();
+	const Bitboard orth = t_pos.pieces(Piece::Type::Rook) | t_pos.pieces(Piece::Type::Queen);
+	const Bitboard diag = t_pos.pieces(Piece::Type::Bishop) | t_pos.pieces(Piece::Type::Queen);
+
+	const Bitboard kings = t_pos.pieces(us, Piece::Type::King);
+	m_has_king = kings != 0; //positions without a king cannot be left in check
+	if (m_has_king) {
+		const Square ksq = m_king_sq = all_squares[lsb(kings)];
+		m_checkers = t_pos.attackers(ksq, occupied) & t_pos.pieces(them);
+		//anywhere, the checking line, or nowhere when double checked
+		if (m_checkers) m_evasion = (popcount(m_checkers) > 1 ? 0 : between_bb(ksq, all_squares[lsb(m_checkers)]) | m_checkers);
+		const Bitboard snipers = ((rook_attacks(ksq, 0) & orth) | (bishop_attacks(ksq, 0) & diag)) & t_pos.pieces(them);
+		m_pinned = lone_blockers(t_pos, ksq, snipers, t_pos.pieces(us));
+	}
+
+	const Bitboard enemy_kings = t_pos.pieces(them, Piece::Type::King);
+	if (with_checks && enemy_kings) {
+		const Square ksq = m_enemy_king_sq = all_squares[lsb(enemy_kings)];
+		m_check_squares[static_cast<uint8_t>(Piece::Type::Pawn)] = pawn_attacks(them, ksq);
+		m_check_squares[static_cast<uint8_t>(Piece::Type::Knight)] = knight_attacks(ksq);
+		m_check_squares[static_cast<uint8_t>(Piece::Type::Bishop)] = bishop_attacks(ksq, occupied);
+		m_check_squares[static_cast<uint8_t>(Piece::Type::Rook)] = rook_attacks(ksq, occupied);
+		m_check_squares[static_cast<uint8_t>(Piece::Type::Queen)] = bishop_attacks(ksq, occupied) | rook_attacks(ksq, occupied);
+		const Bitboard snipers = ((rook_attacks(ksq, 0) & orth) | (bishop_attacks(ksq, 0) & diag)) & t_pos.pieces(us);
+		m_discoverers = lone_blockers(t_pos, ksq, snipers, t_pos.pieces(us));
+	}
+}
+
+bool algorithm::MoveClassifier::legal(MoveRecord m) const
+{
+	if (!m_has_king) return true;
+	const Position& pos = *m_position;
+	const Almnt us = pos.to_move();
+	const Bitboard enemy = pos.pieces(!us);
+	const Bitboard occupied = pos.occupied();
+	const Square si = m.initial();
+	const Square sf = m.final();
+	const Bitboard from = square_bb(si);
+	const Bitboard to = square_bb(sf);
+
+	if (si == m_king_sq) return !(pos.attackers(sf, occupied ^ from) & enemy);
+	if (pos.at(si).type() == Piece::Type::Pawn && pos.en_passant_target() && sf == *pos.en_passant_target()) {
+		const Bitboard captured = square_bb(all_squares[sf.index() + (us == Almnt::White ? -8 : 8)]);
+		return !(pos.attackers(m_king_sq, (occupied ^ from ^ captured) | to) & enemy & ~captured);
+	}
+	if (!(to & m_evasion)) return false;
+	return !(from & m_pinned) || (to & line_bb(m_king_sq, si));
+}
+
+bool algorithm::MoveClassifier::capture(MoveRecord m) const
+{
+	const Position& pos = *m_position;
+	if (m.is_promo() || (pos.pieces(!pos.to_move()) & square_bb(m.final()))) return true;
+	return pos.at(m.initial()).type() == Piece::Type::Pawn && pos.en_passant_target() && m.final() == *pos.en_passant_target();
+}
+
+bool algorithm::MoveClassifier::gives_check(MoveRecord m) const
+{
+	const Square si = m.initial();
+	const Square sf = m.final();
+	const Piece::Type moved = (m.is_promo() ? *m.promo_type() : m_position->at(si).type());
+	if (m_check_squares[static_cast<uint8_t>(moved)] & square_bb(sf)) return true;
+	return (m_discoverers & square_bb(si)) && !(line_bb(m_enemy_king_sq, si) & square_bb(sf));
+}
+
+Bitboard algorithm::MoveClassifier::check_targets(Square start) const
+{
+	if (m_discoverers & square_bb(start)) return ~Bitboard{0};
+	return m_check_squares[static_cast<uint8_t>(m_position->at(start).type())];
+}
+
+//masks by the evasion squares and the pin line, so that only king moves and en passant are tried one at a time
+Bitboard algorithm::MoveClassifier::legal_targets(Square start, Bitboard targets) const
+{
+	if (!m_has_king) return targets;
+	const Position& pos = *m_position;
+	if (start == m_king_sq) {
+		Bitboard out = 0;
+		for (Bitboard b = targets; b;) {
+			const Square end = all_squares[pop_lsb(b)];
+			if (legal(MoveRecord(start, end))) out |= square_bb(end);
 		}
-		m_moves[0] = move(new_w);
-		m_moves[1] = move(new_b);
-	};
-	
-	//get_occlusion(start); //need to handle castling occlusion
-	//get_occlusion(end);
-	prune_moves();
+		return out;
+	}
+	Bitboard out = targets & m_evasion;
+	if (m_pinned & square_bb(start)) out &= line_bb(m_king_sq, start);
+	const optional<Square> ep = pos.en_passant_target();
+	if (ep && (targets & square_bb(*ep)) && pos.at(start).type() == Piece::Type::Pawn) {
+		out &= ~square_bb(*ep);
+		if (legal(MoveRecord(start, *ep))) out |= square_bb(*ep);
+	}
+	return out;
+}
 
-	m_position = Position(m_position, mv);
+algorithm::StagedMoves::StagedMoves(const Position& t_pos)
+	: m_position(&t_pos), m_classifier(t_pos)
+{
+}
 
-	append_calculation(end);
-	for (int i = 0;i < info.counts[0]; i++) append_calculation(info.squares[0][i]); //only call as many times as nencessary
-	for (int i = 0;i < info.counts[1]; i++) append_calculation(info.squares[1][i]);
-	append_castling();
+optional<MoveRecord> algorithm::StagedMoves::next()
+{
+	while (m_next == m_moves.size()) {
+		if (m_pending == Stage::Done) {
+			m_current = Stage::Done;
+			return nullopt;
+		}
+		m_current = m_pending;
+		m_pending = static_cast<Stage>(static_cast<uint8_t>(m_pending) + 1);
+		generate(m_current);
+	}
+	return m_moves[m_next++];
+}
 
-	Piece p = pos().at(start);
-	if (p.type() == Piece::Type::King) {
-		m_king_sq[as_index(p.almnt())] = end;
+void algorithm::StagedMoves::generate(Stage stage)
+{
+	const Position& pos = *m_position;
+	const Almnt us = pos.to_move();
+	const Bitboard enemy = pos.pieces(!us);
+	const Bitboard en_passant = (pos.en_passant_target() ? square_bb(*pos.en_passant_target()) : 0);
+	m_moves.clear();
+	m_next = 0;
+
+	for (Bitboard b = pos.pieces(us); b;) {
+		const Square s = all_squares[pop_lsb(b)];
+		const bool promo = promotes(pos, s);
+		const Bitboard captures = enemy | (pos.at(s).type() == Piece::Type::Pawn ? en_passant : 0);
+		const Bitboard targets = m_classifier.legal_targets(s, move_targets(pos, s, control_set(pos, s)));
+		if (stage == Stage::Captures) append_targets(s, (promo ? targets : targets & captures), promo, m_moves);
+		else if (promo) continue;
+		else if (stage == Stage::Checks) append_targets(s, targets & ~captures & m_classifier.check_targets(s), false, m_moves);
+		else append_targets(s, targets & ~captures, false, m_moves);
 	}
+
+	const auto rejected = [&](MoveRecord m) {
+		if (stage == Stage::Checks) return !m_classifier.gives_check(m);
+		if (stage == Stage::Quiets) return m_classifier.gives_check(m);
+		return false;
+	};
+	m_moves.erase(remove_if(m_moves.begin(), m_moves.end(), rejected), m_moves.end());
+	if (stage != Stage::Quiets || m_classifier.in_check()) return;
+
+	const auto attacked = [&](Bitboard squares) {
+		for (Bitboard b = squares; b;) if (pos.attackers(all_squares[pop_lsb(b)], pos.occupied()) & enemy) return true;
+		return false;
+	};
+	::append_castling(pos, attacked, m_moves);
 }
 
 int mr_dir(MoveRecord mr)
@@ -233,34 +458,27 @@ AnalysedPosition::occlusion_info algorithm::AnalysedPosition::get_occlusion(Move
 		if (ir == 6 && fr == 4) check_ep = true;
 	}
 
-	typedef pair<int, int> trans;
-	constexpr array<trans, 8> adjacencies {
-	make_pair(0, 1), make_pair(1, 1), make_pair(1, 0), make_pair(1, -1),
-	make_pair(0, -1), make_pair(-1, -1), make_pair(-1, 0), make_pair(-1, 1)
-	};
-
 	const auto check_dir = [&](Square sq, int dir)
 	{
 		assert(dir >= 0);
 		assert(dir < 8);
-		const trans t = adjacencies[dir];
-		auto s = sq.translate(t.first, t.second);
-		int dist = 1;
-		while (s) { //check s isn't start
-			if (*s != start) { //ignore own start square
-				const Piece p {pos().at(*s)};
+		int dist = 0;
+		for (const Square s : ray(dir, sq)) {
+			dist++;
+			if (s != start) { //ignore own start square
+				const Piece p {pos().at(s)};
 				const Piece::Type p_t {p.type()};
 				const Almnt p_a {p.almnt()};
 
 				const auto mark = [&]()
 				{
 					assert(out.counts[as_index(p_a)] < 16);
-					out.squares[as_index(p_a)][out.counts[as_index(p_a)]] = *s;
+					out.squares[as_index(p_a)][out.counts[as_index(p_a)]] = s;
 					out.counts[as_index(p_a)] += 1;
 				};
 				
 				switch(p_t) {
-					case Piece::Type::Empty: break; //continue while loop until hit piece or board edge
+					case Piece::Type::Empty: break; //continue along the ray until hit piece or board edge
 					case Piece::Type::Knight: return;
 					case Piece::Type::Bishop: if (dir % 2 == 1) mark(); return;
 					case Piece::Type::Rook: if(dir % 2 == 0) mark(); return;
@@ -268,43 +486,35 @@ AnalysedPosition::occlusion_info algorithm::AnalysedPosition::get_occlusion(Move
 					case Piece::Type::King: if(dist <= 1) mark(); return;
 					case Piece::Type::Pawn: {
 						//if (moved_almnt == Almnt::White && moved_type == Piece::Type::Queen && start == Square("h5") && end == Square("h3") && pos().at("h2").type() == Piece::Type::Pawn) dump = true;
-						int dist_thresh = (s->rank() != 1 && s->rank() != 6) ? 1 : 2;
+						int dist_thresh = (s.rank() != 1 && s.rank() != 6) ? 1 : 2;
 						if (dist > dist_thresh) return; //too far away
-						//if (dump && *s == Square("h2")) cerr << "noted: ";
+						//if (dump && s == Square("h2")) cerr << "noted: ";
 						if (!check_ep && dir % 4 == 2) return; //horizontal movement not possible TODO: What about en_passant?
 						if (dist == 2 && dir % 4 != 0) return; //double move is vertical
-						bool in_front = sq.rank() > s->rank();
+						bool in_front = sq.rank() > s.rank();
 						if (p_a == Almnt::White && !in_front) return; //white pawns move forward
 						if (p_a == Almnt::Black && in_front) return; //black pawns move backward
 						mark();
-						//if (dump && *s == Square("h2")) cerr << "noted: ";
+						//if (dump && s == Square("h2")) cerr << "noted: ";
 						return;
 					}
 				}
 			}
-			s = s->translate(t.first, t.second);
-			dist++;
 		}
 	};
 
 	const auto check_knights = [&](Square sq)
 	{
-		constexpr array<trans, 8> jumps = {
-			make_pair(1, 2), make_pair(-1, 2), make_pair(1, -2), make_pair(-1, -2),
-			make_pair(2, 1), make_pair(2, -1), make_pair(-2, 1), make_pair(-2, -1)
-		};
-		for (trans t : jumps) {
-			auto s = sq.translate(t.first, t.second);
-			if (!s) continue;
-			if (*s == start) continue;
-			const Piece p {pos().at(*s)};
+		for (Bitboard jumps = knight_attacks(sq) & ~square_bb(start); jumps;) {
+			const Square s = all_squares[pop_lsb(jumps)];
+			const Piece p {pos().at(s)};
 			const Piece::Type p_t {p.type()};
 			const Almnt p_a {p.almnt()};
 
 			if (p_t != Piece::Type::Knight) continue;
 			if (p_a != moved_almnt) continue;
 			assert(out.counts[as_index(p_a)] < 16);
-			out.squares[as_index(p_a)][out.counts[as_index(p_a)]] = *s;
+			out.squares[as_index(p_a)][out.counts[as_index(p_a)]] = s;
 			out.counts[as_index(p_a)] += 1;
 		}
 	};
@@ -349,118 +559,780 @@ ostream& algorithm::operator<<(ostream& os, const AnalysedPosition& ap)
 	os << hline <<endl;
 	for (int i = 7; i >= 0; i--) {
 		for (int j = 0; j < 8; j++) {
-			os << "|  " << ap.m_position.at(chess::all_squares[j + i * 8]) << "  ";
+			os << "|  " << ap.pos().at(chess::all_squares[j + i * 8]) << "  ";
 		}
 		os << "|" << endl;
 		for (int j = 0; j < 8; j++) {
-			os << "|" << (int) ap.m_control[0].get(j, i) << "   " << (int) ap.m_control[1].get(j, i);
+			const Square s = chess::all_squares[j + i * 8];
+			os << "|" << (int) ap.ctrl(Almnt::White, s) << "   " << (int) ap.ctrl(Almnt::Black, s);
 		}
 		os << "|" << endl << hline << endl;
 	}
 
-	for (int j = 0; j < 2; j++){
-		os << (j == 0 ? "White:" : "Black:") << endl;
-		int i = 0;
-		for (auto mr : ap.m_moves[j]) {
-			os << Move(ap.pos(), mr) << " ";
-			i++;
-			if (i >= 7) {os << endl; i = 0;}
-		}
-		if (i != 0) os << endl;
+	os << (ap.pos().to_move() == Almnt::White ? "White:" : "Black:") << endl;
+	int i = 0;
+	for (auto mr : ap.m_moves) {
+		os << Move(ap.pos(), mr) << " ";
+		i++;
+		if (i >= 7) {os << endl; i = 0;}
 	}
+	if (i != 0) os << endl;
 	
 	return os;
 }
 
-algorithm::Node::Node(unique_ptr<const AnalysedPosition> t_apos)
-	: apos(move(t_apos)),
-	white_to_play(apos->pos().to_move() == Almnt::White),
-	//data(apos->moves().size()),
-	edges(vector<Edge>(apos->moves().size()))
-	{}
+bool algorithm::MemoryAccount::charge(size_t bytes)
+{
+	size_t held = m_held.load(memory_order_relaxed);
+	do {
+		if (held + bytes > m_limit.load(memory_order_relaxed)) return false;
+	} while (!m_held.compare_exchange_weak(held, held + bytes, memory_order_relaxed));
+	return true;
+}
+
+algorithm::NodePool::NodePool(MemoryAccount* account) : m_account(account)
+{
+	const unsigned int shards = max(thread::hardware_concurrency(), 1u);
+	for (unsigned int i = 0; i < shards; i++) m_shards.push_back(make_unique<Shard>());
+}
+
+NodePool::Shard& algorithm::NodePool::local_shard()
+{
+	static atomic<unsigned int> next_index = 0;
+	thread_local const unsigned int thread_index = next_index++;
+	return *m_shards[thread_index % m_shards.size()];
+}
+
+void algorithm::NodePool::push_free(Shard& shard, void* address, size_t lines)
+{
+	FreeBlock*& head = shard.free_lists[min(lines, large_lines)];
+	head = new (address) FreeBlock{head, lines};
+	shard.free_lines.fetch_add(lines, memory_order_relaxed);
+}
+
+void* algorithm::NodePool::take_free(Shard& shard, size_t lines)
+{
+	if (shard.free_lines.load(memory_order_relaxed) < lines) return nullptr;
+	FreeBlock* block = nullptr;
+	for (size_t size = lines; size < large_lines && !block; size++) {
+		block = shard.free_lists[size];
+		if (block) shard.free_lists[size] = block->next;
+	}
+	for (FreeBlock** link = &shard.free_lists[large_lines]; !block && *link; link = &(*link)->next) {
+		if ((*link)->lines < lines) continue; //the large blocks are few, the first that fits is taken
+		block = *link;
+		*link = block->next;
+	}
+	if (!block) return nullptr;
+	const size_t size = block->lines;
+	shard.free_lines.fetch_sub(size, memory_order_relaxed);
+	if (size > lines) push_free(shard, reinterpret_cast<CacheLine*>(block) + lines, size - lines);
+	m_used.fetch_add(lines * granularity, memory_order_relaxed);
+	return block;
+}
+
+void* algorithm::NodePool::allocate(size_t bytes, bool limited)
+{
+	const size_t lines = (bytes + granularity - 1) / granularity;
+	Expects(lines > 0 && lines * granularity <= slab_size);
+	Shard& shard = local_shard();
+	{
+		lock_guard<mutex> lk(shard.mx);
+		if (void* const block = take_free(shard, lines)) return block;
+		if (shard.end - shard.cursor >= (ptrdiff_t) lines) {
+			void* const block = shard.cursor;
+			shard.cursor += lines;
+			m_used.fetch_add(lines * granularity, memory_order_relaxed);
+			return block;
+		}
+	}
+	//blocks are mostly freed by whichever thread reclaims or prunes, so look through the other shards before
+	//reserving another slab
+	for (const auto& other : m_shards) {
+		if (other.get() == &shard || other->free_lines.load(memory_order_relaxed) < lines) continue;
+		lock_guard<mutex> lk(other->mx);
+		if (void* const block = take_free(*other, lines)) return block;
+	}
+
+	lock_guard<mutex> lk(shard.mx);
+	if (void* const block = take_free(shard, lines)) return block; //freed meanwhile by another thread
+	if (shard.end - shard.cursor < (ptrdiff_t) lines) {
+		if (m_account) {
+			if (!limited) m_account->force(slab_size);
+			else if (!m_account->charge(slab_size)) return nullptr;
+		}
+		if (shard.end != shard.cursor) push_free(shard, shard.cursor, shard.end - shard.cursor); //keep the tail of the old slab
+		shard.slabs.emplace_back(new CacheLine[slab_size / granularity]);
+		shard.cursor = shard.slabs.back().get();
+		shard.end = shard.cursor + slab_size / granularity;
+		m_reserved.fetch_add(slab_size, memory_order_relaxed);
+	}
+	void* const block = shard.cursor;
+	shard.cursor += lines;
+	m_used.fetch_add(lines * granularity, memory_order_relaxed);
+	return block;
+}
+
+void algorithm::NodePool::deallocate(gsl::span<const Block> blocks)
+{
+	if (blocks.empty()) return;
+	Shard& shard = local_shard();
+	lock_guard<mutex> lk(shard.mx);
+	size_t freed = 0;
+	for (const Block& block : blocks) {
+		const size_t lines = (block.bytes + granularity - 1) / granularity;
+		push_free(shard, block.address, lines);
+		freed += lines * granularity;
+	}
+	m_used.fetch_sub(freed, memory_order_relaxed);
+}
+
+void algorithm::NodePool::merge_free()
+{
+	//blocks are split as they are reused and freed to whichever shard the freeing thread uses, so only the pool as
+	//a whole can tell which are neighbours. the unused ends of the slabs are gathered too
+	vector<unique_lock<mutex>> locks;
+	for (const auto& shard : m_shards) locks.emplace_back(shard->mx); //always in the same order
+	vector<pair<CacheLine*, size_t>> blocks;
+	vector<CacheLine*> slab_starts; //blocks in different slabs are never joined
+	for (const auto& shard : m_shards) {
+		for (FreeBlock*& head : shard->free_lists) {
+			for (FreeBlock* block = head; block; block = block->next) {
+				blocks.emplace_back(reinterpret_cast<CacheLine*>(block), block->lines);
+			}
+			head = nullptr;
+		}
+		shard->free_lines.store(0, memory_order_relaxed);
+		if (shard->end != shard->cursor) blocks.emplace_back(shard->cursor, shard->end - shard->cursor);
+		shard->cursor = shard->end = nullptr;
+		for (const auto& slab : shard->slabs) slab_starts.push_back(slab.get());
+	}
+	const auto by_address = [](const auto& a, const auto& b) {return less<CacheLine*>()(a.first, b.first);};
+	sort(blocks.begin(), blocks.end(), by_address);
+	sort(slab_starts.begin(), slab_starts.end(), less<CacheLine*>());
+
+	vector<pair<CacheLine*, size_t>> merged;
+	for (const auto& block : blocks) {
+		if (!merged.empty() && merged.back().first + merged.back().second == block.first
+			&& !binary_search(slab_starts.begin(), slab_starts.end(), block.first, less<CacheLine*>())) {
+			merged.back().second += block.second;
+		}
+		else merged.push_back(block);
+	}
+	for (size_t i = 0; i < merged.size(); i++) push_free(*m_shards[i % m_shards.size()], merged[i].first, merged[i].second);
+}
+
+namespace {
+	//node block layout: Node, AnalysedBoard unless compact, then visits, values and priors padded to whole vectors,
+	//the child pointers and the moves
+	constexpr size_t align_up(size_t offset, size_t alignment) {return (offset + alignment - 1) / alignment * alignment;}
+	constexpr size_t board_offset = align_up(sizeof(Node), alignof(AnalysedBoard));
+	constexpr size_t stats_offset = align_up(board_offset + sizeof(AnalysedBoard), 32);
+	constexpr size_t compact_stats_offset = align_up(sizeof(Node), 32);
+	static_assert(alignof(AnalysedBoard) <= NodePool::granularity);
+	static_assert(alignof(atomic<Node*>) <= sizeof(uint16_t) * EdgeArrays::lanes);
+
+	size_t node_bytes(int edges, bool compact)
+	{
+		const size_t arrays = EdgeArrays::padded(edges) * (sizeof(int32_t) + sizeof(float) + sizeof(uint16_t)) + edges * sizeof(atomic<Node*>);
+		return (compact ? compact_stats_offset : stats_offset) + arrays + edges * sizeof(MoveRecord);
+	}
+}
+
+namespace {
+	//visits and values are updated by other threads through __atomic builtins, so a vector load straight from them
+	//would race. each lane is read with a relaxed atomic load and the vector built from the lanes in registers.
+	//lanes may be read at slightly different moments, as they would be from separate scalar loads.
+	//first + the lane count must be within the padding
+#if defined(__AVX2__)
+	inline __m256 load_visits(const EdgeArrays& e, int first)
+	{
+		return _mm256_cvtepi32_ps(_mm256_setr_epi32(e.visit_count(first), e.visit_count(first + 1), e.visit_count(first + 2), e.visit_count(first + 3),
+			e.visit_count(first + 4), e.visit_count(first + 5), e.visit_count(first + 6), e.visit_count(first + 7)));
+	}
+
+	inline __m256 load_values(const EdgeArrays& e, int first)
+	{
+		return _mm256_setr_ps(e.value(first), e.value(first + 1), e.value(first + 2), e.value(first + 3),
+			e.value(first + 4), e.value(first + 5), e.value(first + 6), e.value(first + 7));
+	}
+#elif defined(__SSE2__)
+	inline __m128 load_visits(const EdgeArrays& e, int first)
+	{
+		return _mm_cvtepi32_ps(_mm_setr_epi32(e.visit_count(first), e.visit_count(first + 1), e.visit_count(first + 2), e.visit_count(first + 3)));
+	}
+
+	inline __m128 load_values(const EdgeArrays& e, int first)
+	{
+		return _mm_setr_ps(e.value(first), e.value(first + 1), e.value(first + 2), e.value(first + 3));
+	}
+#endif
+}
 
-algorithm::Node::Node(const AnalysedPosition& t_apos)
-	: apos(make_unique<AnalysedPosition>(t_apos)),
-	white_to_play(apos->pos().to_move() == Almnt::White),
+int algorithm::select_edge(const EdgeArrays& edges, bool white_to_play, float explore)
+{
+	Expects(edges.size > 0);
+	//q = offset + sign * mean, which is exact for both sides to move
+	const float sign = (white_to_play ? 1.0f : -1.0f);
+	const float offset = (white_to_play ? 0.0f : 1.0f);
+#if defined(__AVX2__)
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 lowest = _mm256_set1_ps(-INFINITY);
+	const __m256i size = _mm256_set1_epi32(edges.size);
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 best = lowest;
+	__m256i best_index = index;
+	for (int i = 0; i < edges.size; i += 8) {
+		const __m256 visits = load_visits(edges, i);
+		const __m256 mean = _mm256_div_ps(load_values(edges, i), _mm256_max_ps(visits, one));
+		const __m256 q = _mm256_add_ps(_mm256_set1_ps(offset), _mm256_mul_ps(_mm256_set1_ps(sign), mean));
+		const __m256 prior = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(edges.priors + i))), 16));
+		const __m256 u = _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(explore), prior), _mm256_add_ps(one, visits));
+		const __m256 score = _mm256_blendv_ps(lowest, _mm256_add_ps(q, u), _mm256_castsi256_ps(_mm256_cmpgt_epi32(size, index)));
+		const __m256 better = _mm256_cmp_ps(score, best, _CMP_GT_OQ); //strict, so each lane keeps its earliest maximum
+		best = _mm256_blendv_ps(best, score, better);
+		best_index = _mm256_blendv_epi8(best_index, index, _mm256_castps_si256(better));
+		index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+	}
+	__m256 top = _mm256_max_ps(best, _mm256_permute2f128_ps(best, best, 1));
+	top = _mm256_max_ps(top, _mm256_shuffle_ps(top, top, _MM_SHUFFLE(1, 0, 3, 2)));
+	top = _mm256_max_ps(top, _mm256_shuffle_ps(top, top, _MM_SHUFFLE(2, 3, 0, 1)));
+	unsigned int ties = _mm256_movemask_ps(_mm256_cmp_ps(best, top, _CMP_EQ_OQ));
+	alignas(32) array<int32_t, 8> lane_index;
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lane_index.data()), best_index);
+#elif defined(__SSE2__)
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 lowest = _mm_set1_ps(-INFINITY);
+	const __m128i size = _mm_set1_epi32(edges.size);
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+	__m128 best = lowest;
+	__m128i best_index = index;
+	for (int i = 0; i < edges.size; i += 4) {
+		const __m128 visits = load_visits(edges, i);
+		const __m128 mean = _mm_div_ps(load_values(edges, i), _mm_max_ps(visits, one));
+		const __m128 q = _mm_add_ps(_mm_set1_ps(offset), _mm_mul_ps(_mm_set1_ps(sign), mean));
+		const __m128 prior = _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(edges.priors + i))));
+		const __m128 u = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(explore), prior), _mm_add_ps(one, visits));
+		const __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(size, index));
+		const __m128 score = _mm_or_ps(_mm_and_ps(valid, _mm_add_ps(q, u)), _mm_andnot_ps(valid, lowest));
+		const __m128 better = _mm_cmpgt_ps(score, best);
+		best = _mm_or_ps(_mm_and_ps(better, score), _mm_andnot_ps(better, best));
+		best_index = _mm_or_si128(_mm_and_si128(_mm_castps_si128(better), index), _mm_andnot_si128(_mm_castps_si128(better), best_index));
+		index = _mm_add_epi32(index, _mm_set1_epi32(4));
+	}
+	__m128 top = _mm_max_ps(best, _mm_shuffle_ps(best, best, _MM_SHUFFLE(1, 0, 3, 2)));
+	top = _mm_max_ps(top, _mm_shuffle_ps(top, top, _MM_SHUFFLE(2, 3, 0, 1)));
+	unsigned int ties = _mm_movemask_ps(_mm_cmpeq_ps(best, top));
+	alignas(16) array<int32_t, 4> lane_index;
+	_mm_store_si128(reinterpret_cast<__m128i*>(lane_index.data()), best_index);
+#else
+	int best_index = 0;
+	float best = -INFINITY;
+	for (int i = 0; i < edges.size; i++) {
+		const float visits = edges.visit_count(i);
+		const float q = offset + sign * (edges.value(i) / max(visits, 1.0f));
+		const float score = q + explore * unpack_prior(edges.priors[i]) / (1.0f + visits);
+		if (score > best) {
+			best = score;
+			best_index = i;
+		}
+	}
+	return best_index;
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+	//the lowest index among the lanes holding the maximum
+	int out = edges.size;
+	for (; ties != 0; ties &= ties - 1) out = min(out, lane_index[__builtin_ctz(ties)]);
+	return out;
+#endif
+}
+
+float algorithm::value_sum(const EdgeArrays& edges)
+{
+	//padding lanes hold zero, the values are read a lane at a time as in select_edge
+#if defined(__AVX2__)
+	__m256 total = _mm256_setzero_ps();
+	for (int i = 0; i < edges.size; i += 8) {
+		total = _mm256_add_ps(total, load_values(edges, i));
+	}
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	return _mm_cvtss_f32(_mm_add_ss(half, _mm_shuffle_ps(half, half, 1)));
+#elif defined(__SSE2__)
+	__m128 total = _mm_setzero_ps();
+	for (int i = 0; i < edges.size; i += 4) {
+		total = _mm_add_ps(total, load_values(edges, i));
+	}
+	total = _mm_add_ps(total, _mm_movehl_ps(total, total));
+	return _mm_cvtss_f32(_mm_add_ss(total, _mm_shuffle_ps(total, total, 1)));
+#else
+	float total = 0.0f;
+	for (int i = 0; i < edges.size; i++) total += edges.value(i);
+	return total;
+#endif
+}
+
+algorithm::Node::Node(NodePool& t_pool, const AnalysedBoard* t_board, bool t_white_to_play, const EdgeArrays& t_edges)
+	: board(t_board),
+	white_to_play(t_white_to_play),
+	m_pool(t_pool),
 	//data(apos->moves().size()),
-	edges(vector<Edge>(apos->moves().size()))
+	edges(t_edges)
 	{}
 
+NodePtr algorithm::Node::create(NodePool& pool, const AnalysedPosition& t_apos, bool compact, bool limited)
+{
+	const int edges_num = t_apos.moves().size();
+	const int padded = EdgeArrays::padded(edges_num);
+	byte* const block = static_cast<byte*>(pool.allocate(node_bytes(edges_num, compact), limited));
+	if (!block) return nullptr;
+	const AnalysedBoard* const board = (compact ? nullptr : new (block + board_offset) AnalysedBoard(t_apos.board()));
+
+	EdgeArrays edges;
+	edges.size = edges_num;
+	edges.visits = reinterpret_cast<int32_t*>(block + (compact ? compact_stats_offset : stats_offset));
+	edges.values = reinterpret_cast<float*>(edges.visits + padded);
+	edges.priors = reinterpret_cast<uint16_t*>(edges.values + padded);
+	edges.children = reinterpret_cast<atomic<Node*>*>(edges.priors + padded);
+	uninitialized_fill_n(edges.visits, padded, 0);
+	uninitialized_fill_n(edges.values, padded, 0.0f);
+	uninitialized_fill_n(edges.priors, padded, pack_prior(1.0f));
+	for (int i = 0; i < edges_num; i++) new (edges.children + i) atomic<Node*>(nullptr);
+	Node* const node = new (block) Node(pool, board, t_apos.pos().to_move() == Almnt::White, edges);
+	node->m_moves = uninitialized_copy(t_apos.moves().begin(), t_apos.moves().end(), reinterpret_cast<MoveRecord*>(edges.children + edges_num)) - edges_num;
+	node->m_key = transposition_key(t_apos.pos());
+	node->m_in_check = t_apos.legal_check(); //kept so that a compact node can tell checkmate from stalemate
+	return NodePtr(node);
+}
+
+void algorithm::NodeDeleter::operator()(Node* root) const
+{
+	//iterative so that long lines do not exhaust the stack, all blocks are handed back in one batch.
+	//a child is only released once the last edge leading to it is gone
+	NodePool& pool = root->m_pool;
+	vector<Node*> pending = {root};
+	vector<NodePool::Block> blocks;
+	while (!pending.empty()) {
+		Node* const node = pending.back();
+		pending.pop_back();
+		const bool last = (node->m_table ? node->m_table->release(node) : node->m_references.fetch_sub(1, memory_order_acq_rel) == 1);
+		if (!last) continue; //still reachable through a transposition
+		const int edges_num = node->edges.size;
+		for (int i = 0; i < edges_num; i++) {
+			Node* const child = node->edges.children[i].load(memory_order_relaxed);
+			if (child) pending.push_back(child);
+		}
+		blocks.push_back({node, node_bytes(edges_num, !node->board)});
+		if (node->board) node->board->~AnalysedBoard();
+		node->~Node();
+	}
+	pool.deallocate(blocks);
+}
+
+algorithm::Reclaimer::~Reclaimer()
+{
+	{
+		lock_guard<mutex> lk(m_mx);
+		m_halt = true;
+	}
+	m_cv.notify_all();
+	if (m_thread.joinable()) m_thread.join();
+}
+
+void algorithm::Reclaimer::discard(NodePtr node)
+{
+	if (!node) return;
+	bool schedule = false;
+	{
+		lock_guard<mutex> lk(m_mx);
+		m_queue.push_back(move(node));
+		if (m_executor) {
+			schedule = !m_scheduled;
+			m_scheduled = true;
+		}
+		else if (!m_thread.joinable()) m_thread = thread([this]() {run();});
+	}
+	if (schedule) m_executor([this]() {drain();});
+	else m_cv.notify_all();
+}
+
+void algorithm::Reclaimer::wait_idle()
+{
+	unique_lock<mutex> lk(m_mx);
+	m_cv.wait(lk, [this]() {return m_queue.empty() && !m_busy && !m_scheduled;});
+}
+
+void algorithm::Reclaimer::set_executor(function<void(function<void()>)> executor)
+{
+	lock_guard<mutex> lk(m_mx);
+	Expects(!m_thread.joinable() && m_queue.empty());
+	m_executor = move(executor);
+}
+
+void algorithm::Reclaimer::drain()
+{
+	unique_lock<mutex> lk(m_mx);
+	while (!m_queue.empty()) {
+		vector<NodePtr> batch;
+		swap(batch, m_queue);
+		m_busy = true;
+		lk.unlock();
+		batch.clear();
+		lk.lock();
+		m_busy = false;
+	}
+	m_scheduled = false;
+	m_cv.notify_all();
+}
+
+void algorithm::Reclaimer::run()
+{
+	unique_lock<mutex> lk(m_mx);
+	while (true) {
+		m_cv.wait(lk, [this]() {return m_halt || !m_queue.empty();});
+		if (m_queue.empty()) return; //halted with nothing left to free
+		vector<NodePtr> batch;
+		swap(batch, m_queue);
+		m_busy = true;
+		lk.unlock();
+		batch.clear(); //nodes still reachable from the new base only lose a reference, see NodeDeleter
+		lk.lock();
+		m_busy = false;
+		m_cv.notify_all();
+	}
+}
+
+algorithm::TranspositionTable::TranspositionTable(MemoryAccount* account) : m_account(account)
+{
+	for (Shard& s : m_shards) s.buckets.resize(64, nullptr);
+	if (m_account) m_account->force(bucket_bytes());
+}
+
+NodePtr algorithm::TranspositionTable::acquire(uint64_t key)
+{
+	Shard& s = shard(key);
+	lock_guard<mutex> lk(s.mx);
+	for (Node* node = s.buckets[bucket(s, key)]; node; node = node->m_next_entry) {
+		if (node->m_key == key) {
+			node->m_references.fetch_add(1, memory_order_relaxed);
+			return NodePtr(node);
+		}
+	}
+	return nullptr;
+}
+
+bool algorithm::TranspositionTable::insert(NodePtr& node)
+{
+	NodePtr discarded; //destroyed after the lock is released
+	Shard& s = shard(node->m_key);
+	lock_guard<mutex> lk(s.mx);
+	Node*& head = s.buckets[bucket(s, node->m_key)];
+	for (Node* listed = head; listed; listed = listed->m_next_entry) {
+		if (listed->m_key == node->m_key) {
+			listed->m_references.fetch_add(1, memory_order_relaxed);
+			discarded = move(node);
+			node.reset(listed);
+			return false;
+		}
+	}
+	node->m_next_entry = head;
+	node->m_table = this;
+	head = node.get();
+	if (++s.count > s.buckets.size()) grow(s);
+	return true;
+}
+
+void algorithm::TranspositionTable::grow(Shard& s)
+{
+	if (m_account && !m_account->charge(s.buckets.size() * sizeof(Node*))) return;
+	vector<Node*> old(s.buckets.size() * 2, nullptr);
+	swap(old, s.buckets);
+	for (Node* node : old) {
+		while (node) {
+			Node* const next = node->m_next_entry;
+			Node*& head = s.buckets[bucket(s, node->m_key)];
+			node->m_next_entry = head;
+			head = node;
+			node = next;
+		}
+	}
+}
+
+bool algorithm::TranspositionTable::release(Node* node)
+{
+	Shard& s = shard(node->m_key);
+	lock_guard<mutex> lk(s.mx);
+	if (node->m_references.fetch_sub(1, memory_order_acq_rel) > 1) return false;
+	Node** link = &s.buckets[bucket(s, node->m_key)];
+	while (*link != node) link = &(*link)->m_next_entry;
+	*link = node->m_next_entry;
+	node->m_table = nullptr;
+	s.count--;
+	return true;
+}
+
+size_t algorithm::TranspositionTable::size() const
+{
+	size_t total = 0;
+	for (const Shard& s : m_shards) {
+		lock_guard<mutex> lk(s.mx);
+		total += s.count;
+	}
+	return total;
+}
+
+size_t algorithm::TranspositionTable::bucket_bytes() const
+{
+	size_t total = 0;
+	for (const Shard& s : m_shards) {
+		lock_guard<mutex> lk(s.mx);
+		total += s.buckets.capacity() * sizeof(Node*);
+	}
+	return total;
+}
+
 void algorithm::Node::increment_n() {
-	data_mutex.lock();
 	//data.total_n += 1;
-	m_total_n += 1;
-	data_mutex.unlock();
+	m_visits.fetch_add(1, memory_order_relaxed);
 }
 
 int algorithm::Node::preferred_index()
 {
-	unsigned int i = 0;
-	int max_n = edges[0].visits;
-	unsigned int max_loc = 0;
-	i++;
-	for (; i < edges.size(); i++) {
-		if (edges[i].visits > max_n) {
-			max_n = edges[i].visits;
+	Expects(edges.size > 0);
+	int max_loc = 0;
+	int max_n = edges.visit_count(0);
+	for (int i = 1; i < edges.size; i++) {
+		const int visits = edges.visit_count(i);
+		if (visits > max_n) {
+			max_n = visits;
 			max_loc = i;
 		}
 	}
-	return (int) max_loc;
+	return max_loc;
+}
+
+Node* algorithm::Node::find_child(const Position& pos)
+{
+	Expects(board);
+	const uint64_t target = pos.hash_bar_ep(); //some interfaces omit the en passant target
+	for (int i = 0; i < edges.size; i++) {
+		Position child_pos = board->pos();
+		child_pos.make_move(edge_move(i));
+		if (child_pos.hash_bar_ep() == target) return child(i);
+	}
+	return nullptr;
 }
 
-bool equal_bar_ep (const string & fen1, const string & fen2)
+Node* algorithm::Node::find_child(const string& fen)
 {
-	stringstream ss1(fen1);
-	stringstream ss2(fen2);
+	return find_child(Position(fen));
+}
 
-	for (int i = 0; i < 6; i++) {
-		string word1;
-		ss1 >> word1;
-		string word2;
-		ss2 >> word2;
-		if (i == 3) continue;
-		if (word1 != word2) return false;
+Node* algorithm::Node::find_child(const Move& mv)
+{
+	for (int i = 0; i < edges.size; i++) {
+		if (edge_move(i) == mv.record()) {
+			//assert(equal_bar_ep(edge.node->apos->pos().as_fen(), fen)); //verify new function
+			return child(i);
+		}
 	}
+	return nullptr;
+}
+
+bool algorithm::Node::publish_child(int index, NodePtr& t_child)
+{
+	Node* expected = nullptr;
+	if (!edges.children[index].compare_exchange_strong(expected, t_child.get(), memory_order_acq_rel)) return false;
+	t_child.release();
 	return true;
 }
 
-unique_ptr<Node>* algorithm::Node::find_child(const string& fen)
+NodePtr algorithm::Node::detach_child(const Node* t_child)
 {
-	for (auto& edge : edges) {
-		if (edge.node) {
-			//cerr << edge.node->apos->pos().as_fen() << " --VS-- " << fen << endl;
-			if (equal_bar_ep(edge.node->apos->pos().as_fen(), fen)) {
-				//assert(equal_bar_ep(edge.node->apos->pos().as_fen(), fen)); //verify new function
-				return &edge.node;
-			}
-		}
+	if (!t_child) return nullptr;
+	for (int i = 0; i < edges.size; i++) {
+		Node* expected = const_cast<Node*>(t_child);
+		if (edges.children[i].compare_exchange_strong(expected, nullptr, memory_order_acq_rel)) return NodePtr(expected);
 	}
 	return nullptr;
 }
 
-unique_ptr<Node>* algorithm::Node::find_child(const Move& mv)
+algorithm::Tree::Tree(
+	const AnalysedPosition& base_apos,
+	function<float(const AnalysedPosition&)> t_value_fn,
+	function<float(const AnalysedPosition&, const Move&)> t_prior_fn,
+	float t_expl_c
+)	: m_memory(make_unique<MemoryAccount>()), m_pool(make_unique<NodePool>(m_memory.get())),
+	m_table(make_unique<TranspositionTable>(m_memory.get())), m_reclaimer(make_unique<Reclaimer>()), value_fn(t_value_fn), prior_fn(t_prior_fn), expl_c(t_expl_c),
+	m_base_apos(base_apos)
+{
+	AnalysedPosition ordered(base_apos);
+	ordered.order_moves();
+	base = Node::create(*m_pool, ordered);
+	assign_priors(*base, ordered);
+	m_table->insert(base);
+	m_roots[0] = {base.get(), m_base_apos};
+}
+
+bool algorithm::Tree::advance_to(const Position& pos)
+{
+	const uint64_t target = pos.hash_bar_ep(); //some interfaces omit the en passant target
+	for (int i = 0; i < base->edges_num(); i++) {
+		Position child_pos = m_base_apos.pos();
+		child_pos.make_move(base->edge_move(i));
+		if (child_pos.hash_bar_ep() == target) return advance(i);
+	}
+	return false;
+}
+
+bool algorithm::Tree::advance_by(const Move& mv)
+{
+	for (int i = 0; i < base->edges_num(); i++) {
+		if (base->edge_move(i) == mv.record()) return advance(i);
+	}
+	return false;
+}
+
+bool algorithm::Tree::advance(int index)
+{
+	Node* child = base->child(index);
+	if (!child) { //never expanded, or pruned since
+		optional<AnalysedPosition> leaf;
+		NodePtr expanded = expand({base.get()}, {index}, m_base_apos, leaf, false); //the base must exist, room or not
+		child = expanded.get();
+		if (!base->publish_child(index, expanded)) child = base->child(index); //a search expanded it meanwhile
+	}
+	NodePtr next = base->detach_child(child);
+	if (!next) return false;
+	m_base_apos.advance_by(base->edge_move(index));
+	NodePtr previous = exchange(base, move(next));
+	publish_root();
+	m_reclaimer->discard(move(previous)); //the old base and the siblings of the new one
+	return true;
+}
+
+int algorithm::Tree::enter()
+{
+	//sequentially consistent so that publish_root either sees this search counted or the search sees the new epoch
+	while (true) {
+		const uint64_t epoch = m_epoch.load();
+		const int slot = epoch & 1;
+		m_active[slot].fetch_add(1);
+		if (m_epoch.load() == epoch) return slot;
+		m_active[slot].fetch_sub(1); //the root moved on meanwhile
+	}
+}
+
+void algorithm::Tree::leave(int slot)
+{
+	m_active[slot].fetch_sub(1);
+}
+
+void algorithm::Tree::publish_root()
+{
+	//the other slot was drained at the end of the previous call
+	const uint64_t epoch = m_epoch.load();
+	m_roots[(epoch + 1) & 1] = {base.get(), m_base_apos};
+	m_epoch.store(epoch + 1);
+	while (m_active[epoch & 1].load() != 0) this_thread::yield(); //at most one playout or batch on each thread
+}
+
+const Move algorithm::Tree::best_move() const
+{
+	return Move(m_base_apos.pos(), base->edge_move(base->preferred_index()));
+}
+
+size_t algorithm::Tree::memory_used() const
+{
+	return m_memory->held(); //the slabs of the pool and the buckets of the table
+}
+
+size_t algorithm::Tree::memory_live() const
 {
-	for (int i = 0; i < (int) edges.size(); i++) {
-		if (edges[i].node) {
-			if (apos->moves()[i] == mv.record()) {
-				//assert(equal_bar_ep(edge.node->apos->pos().as_fen(), fen)); //verify new function
-				return &edges[i].node;
+	return m_pool->used_bytes() + m_table->bucket_bytes();
+}
+
+void algorithm::Tree::prune(size_t target)
+{
+	//a subtree has at most as many nodes as the edge above it has visits, so raising the threshold frees the
+	//smallest subtrees first. a pass stops as soon as the target is met, the thresholds double so that one pass
+	//could otherwise free far more than needed. the buckets do not shrink, so they are counted once
+	const size_t table_bytes = m_table->bucket_bytes();
+	const auto fits = [&] {return m_pool->used_bytes() + table_bytes <= target;};
+	for (int threshold = 1; !fits() && threshold <= base->total_n(); threshold *= 2) {
+		vector<Node*> pending = {base.get()};
+		unordered_set<const Node*> seen = {base.get()};
+		while (!pending.empty() && !fits()) {
+			Node* const node = pending.back();
+			pending.pop_back();
+			for (int i = 0; i < node->edges.size; i++) {
+				Node* const next = node->child(i);
+				if (!next) continue;
+				if (node->edges.visit_count(i) <= threshold) {
+					NodePtr(node->edges.children[i].exchange(nullptr, memory_order_acq_rel)); //released here
+				}
+				else if (seen.insert(next).second) pending.push_back(next);
 			}
 		}
 	}
-	return nullptr;
+	m_pool->merge_free();
+	m_starved.store(false, memory_order_relaxed);
+}
+
+NodePtr algorithm::Tree::expand(const vector<Node*>& nodes, const vector<int>& indices, const AnalysedPosition& base_apos,
+	optional<AnalysedPosition>& leaf, bool limited)
+{
+	//start from the deepest node on the path that still has its position
+	const int depth = nodes.size() - 1;
+	int start = depth;
+	while (start > 0 && !nodes[start]->board) start--;
+	const AnalysedBoard& origin = (nodes[start]->board ? *nodes[start]->board : base_apos.board());
+
+	//look the child up before paying for its analysis
+	Position child_pos = origin.pos();
+	for (int i = start; i <= depth; i++) child_pos.make_move(nodes[i]->edge_move(indices[i]));
+	NodePtr child = m_table->acquire(transposition_key(child_pos));
+	if (child) return child;
+
+	//only the control maps are updated along the way, the moves are generated once at the end
+	AnalysedBoard board = origin;
+	for (int i = start; i <= depth; i++) board.advance_by(nodes[i]->edge_move(indices[i]));
+	AnalysedPosition& new_apos = leaf.emplace(board);
+	new_apos.order_moves(); //expand captures and checks first
+	child = Node::create(*m_pool, new_apos, compact && depth + 1 > full_depth, limited);
+	if (!child) {
+		m_starved.store(true, memory_order_relaxed);
+		return nullptr;
+	}
+	assign_priors(*child, new_apos);
+	if (!m_table->insert(child)) leaf.reset(); //another thread listed the position first
+	return child;
+}
+
+void algorithm::Tree::assign_priors(Node& node, const AnalysedPosition& apos) const
+{
+	//scaled to a mean of 1 rather than a sum of 1, so that uniform priors explore exactly as plain UCT did and
+	//expl_c keeps its meaning
+	const int edges_num = node.edges.size;
+	if (!prior_fn || edges_num == 0) return;
+	array<float, MoveList::capacity> priors;
+	Expects(edges_num <= (int) priors.size());
+	float total = 0.0f;
+	for (int i = 0; i < edges_num; i++) {
+		priors[i] = max(prior_fn(apos, apos.get_move(i)), 0.0f);
+		total += priors[i];
+	}
+	if (!(total > 0.0f)) return; //no preference, keep the uniform weights
+	const float scale = edges_num / total;
+	for (int i = 0; i < edges_num; i++) node.edges.priors[i] = pack_prior(priors[i] * scale);
 }
 
 optional<int> algorithm::Tree::edge_to_search(Node& node)
 {
-	node.data_mutex.lock();
+	if (node.edges.size == 0) return nullopt; //checkmate or stalemate
 	//hacky code to fix search impotence while winning !!this cuts performance by ~10%!!
-	float node_avg = 0.0; 
-	for (const auto& ed : node.edges) {
-		if (!ed.legal()) continue;
-		node_avg += ed.total_value;
-	}
-	node_avg /= node.m_total_n;
+	const int total_n = node.total_n();
+	const float node_avg = value_sum(node.edges) / total_n;
 	float margin = 0.5 - abs(node_avg - 0.5);
 	if (margin == 0.0) margin = 0.5;
 	//cerr << node_avg << " <:> " << margin << endl;
@@ -468,46 +1340,22 @@ optional<int> algorithm::Tree::edge_to_search(Node& node)
 	//disable margin
 //	float margin = 0.5;
 
-	const auto evaluate = [&](const Edge& ed) {
-		if (!ed.legal()) return -1.0f;
-		const float avg_val = (ed.visits == 0 ? 0.0 : ed.total_value / ed.visits);//ed.total_value / ((float) ed.visits + 0.01f);
-		const float oriented_val = (node.white_to_play ? avg_val : 1.0f - avg_val);
-		const float expl = expl_c * sqrt(node.m_total_n) / (1 + ed.visits) * 2.0 * margin;
-		return oriented_val + expl;
-	};
-
-	
-	const auto& vec = node.edges;
-	unsigned int i = 0;
-	unsigned int max_pos = i;
-	float max_eval = evaluate(vec[i]);
-	i++;
-	for (; i < vec.size(); i++) {
-		const float new_eval = evaluate(vec[i]);
-		if (new_eval > max_eval) {
-			max_pos = i;
-			max_eval = new_eval;
-		}
-	}
-	
-	node.data_mutex.unlock();
-	if (max_eval == -1.0) return nullopt;
-	return (int) max_pos;
+	return select_edge(node.edges, node.white_to_play, expl_c * sqrt((float) total_n) * 2.0f * margin);
 }
 
 void algorithm::Tree::update_prefetch(Node& node) //this algorithm is broken if the first move is best
 {
 	node.node_prefetch = {0};
-	assert(node.edges.size() < 256);
+	assert(node.edges.size < 256);
 	assert(node.node_prefetch.size() < 256);
-	for (uint8_t j = 0; j < node.edges.size(); j++) {
-		int to_compare = node.edges[j].visits;
+	for (uint8_t j = 0; j < node.edges.size; j++) {
+		int to_compare = node.edges.visit_count(j);
 		uint8_t new_index = j;
 		for (uint8_t i = 0; i < node.node_prefetch.size(); i++) {
 			const uint8_t pfi = node.node_prefetch[i];
 			//if (new_index == pfi) break;
-			if (to_compare > node.edges[pfi].visits) {
-				to_compare = node.edges[pfi].visits;
+			if (to_compare > node.edges.visit_count(pfi)) {
+				to_compare = node.edges.visit_count(pfi);
 				uint8_t temp = node.node_prefetch[i]; //use std::swap()?
 				node.node_prefetch[i] = new_index;
 				new_index = temp;
@@ -518,26 +1366,26 @@ void algorithm::Tree::update_prefetch(Node& node) //this algorithm is broken if
 	//for (uint8_t pfi : node.node_prefetch) assert(pfi < node.edges.size());
 }
 
-void algorithm::Node::update(int index, float t_value) {
-	data_mutex.lock();
-	m_total_n += 1;
-	edges.at(index).visits += 1;
-	edges.at(index).total_value += t_value;
-	data_mutex.unlock();
+void algorithm::Node::update(int index, float t_value, int t_virtual_loss) {
+	Expects(index >= 0 && index < edges.size);
+	const float lost = (white_to_play ? 0.0f : 1.0f); //value of a loss for the side to move
+	m_visits.fetch_add(1 - (static_cast<uint64_t>(t_virtual_loss) << 32), memory_order_relaxed); //wraps to a subtraction
+	edges.add_visits(index, 1 - t_virtual_loss);
+	edges.add_value(index, t_value - t_virtual_loss * lost);
 }
 
-void algorithm::Node::set_illegal(int index) {
-	data_mutex.lock();
-	//cerr << edges[index].visits << " ";
-	assert(edges[index].visits <= 0);
-	edges[index].visits = -1;
-	data_mutex.unlock();
+void algorithm::Node::add_virtual_loss(int index, int t_virtual_loss) {
+	if (t_virtual_loss == 0) return;
+	const float lost = (white_to_play ? 0.0f : 1.0f);
+	m_visits.fetch_add(static_cast<uint64_t>(t_virtual_loss) << 32, memory_order_relaxed);
+	edges.add_visits(index, t_virtual_loss);
+	if (lost != 0.0f) edges.add_value(index, t_virtual_loss * lost);
 }
 
 string algorithm::Node::display() const
 { //use GameResult TODO
 	stringstream output;
-	output << apos->pos().as_fen() << endl;
+	output << (board ? board->pos().as_fen() : "compact node") << endl;
 	//output << "Victor: ";
 	//if (result) {
 	//	if (result.value() == 1.0) output << "White" << endl;
@@ -545,12 +1393,14 @@ string algorithm::Node::display() const
 	//	else output << "ERROR" << endl;
 	//}
 	//else output << "none" << endl;
-	output << "Total N: " << m_total_n << endl;
-	for (unsigned int i = 0; i < edges.size(); i++) {
-		output << apos->get_move(i) << ": ";
-		output << edges[i].visits << " ";
-		if (edges[i].visits > 0) {
-			output << edges[i].total_value / (float) edges[i].visits << endl;
+	output << "Total N: " << total_n() << endl;
+	for (int i = 0; i < edges.size; i++) {
+		if (board) output << Move(board->pos(), edge_move(i)) << ": ";
+		else output << edge_move(i) << ": ";
+		const int visits = edges.visit_count(i);
+		output << visits << " ";
+		if (visits > 0) {
+			output << edges.value(i) / (float) visits << endl;
 		}
 		else {
 			output << "unknown" << endl;
@@ -564,69 +1414,6 @@ string algorithm::Node::display() const
 	return output.str();
 }
 
-float algorithm::Tree::evaluate_node(Node& node)
-{
-	//if result determined return
-	if (node.result()) {
-		node.increment_n();
-		return evaluate(node.result().value());
-	}
-
-	//choose edge to search & check for end of game
-	int total = 0;
-	for (Edge& ed : node.edges) total += ed.visits;
-	
-	const auto search_res = edge_to_search(node);
-	if (!search_res) {
-		if (node.apos->legal_check()) {
-			node.m_result = make_optional<GameResult>(victory(!node.apos->pos().to_move()));
-		}
-		else {
-			node.m_result = make_optional<GameResult>(GameResult::Draw);
-		}
-		return evaluate_node(node);
-	}
-	const int index = search_res.value();
-	
-	float evaluation;
-	//node.edges[index].ptr_mutex.lock();
-	node.data_mutex.lock();
-	auto& node_ptr = node.edges[index].node;
-	if (node_ptr) {
-		//node.edges[index].ptr_mutex.unlock();
-		node.data_mutex.unlock();
-		evaluation = evaluate_node(*node_ptr);
-	}
-	else {
-		Move mv = node.apos->get_move(index);
-		//cerr << node.apos->get_move(index) << endl;
-		//Position pos2(node.apos->pos(), mv);
-		unique_ptr<AnalysedPosition> new_apos;
-		if (true || mv.is_en_passant() || mv.is_castling() || mv.is_promotion()) { //"true" to disable experimental move calculation
-			new_apos = make_unique<AnalysedPosition>(node.apos->get_move(index).apply());
-		}
-		else {
-			new_apos = make_unique<AnalysedPosition>(*node.apos);
-			new_apos->advance_by(mv.record());
-		}
-		//auto new_apos = make_unique<AnalysedPosition>(node.apos->get_move(index).apply());//(Position(node.apos->pos(), node.apos->moves()[index]));
-		if (new_apos->illegal_check()) {
-			//node.edges[index].ptr_mutex.unlock();
-			node.data_mutex.unlock();
-			node.set_illegal(index);
-			return evaluate_node(node);
-		}
-		else {
-			node_ptr = make_unique<Node>(move(new_apos));;
-			//node.edges[index].ptr_mutex.unlock();
-			node.data_mutex.unlock();
-			evaluation = value_fn(*node_ptr->apos);
-		}
-	}
-	node.update(index, evaluation);
-	return evaluation;
-}
-
 //void algorithm::Tree::search()
 //{
 //	if (base) evaluate_node(*base);
@@ -637,12 +1424,48 @@ float algorithm::Tree::evaluate_node(Node& node)
 // a rare node.
 void algorithm::Tree::search(bool t_update_prefetch)
 {
-	vector<Node*> nodes;
-	vector<int> indices;
+	const int vloss = virtual_loss; //the same amount must be withdrawn on the way back up
+	const int slot = enter();
+	Playout playout;
+	descend(playout, m_roots[slot], vloss);
+	backup(playout, (playout.evaluation ? *playout.evaluation : value_fn(*playout.leaf)), vloss);
+	leave(slot);
+}
+
+void algorithm::Tree::search_batch(int size)
+{
+	Expects(size > 0);
+	//virtual loss keeps the playouts of a batch apart, without it they would all follow the first one's path
+	const int vloss = max(virtual_loss, 1);
+	vector<Playout> playouts(size);
+	vector<const AnalysedPosition*> leaves;
+	leaves.reserve(size);
+	const int slot = enter(); //for the whole batch, its paths stay open until the backups
+	for (Playout& playout : playouts) {
+		descend(playout, m_roots[slot], vloss);
+		if (!playout.evaluation) leaves.push_back(&*playout.leaf);
+	}
+
+	vector<float> values(leaves.size());
+	if (batch_value_fn && !leaves.empty()) {
+		batch_value_fn({leaves.data(), (ptrdiff_t) leaves.size()}, {values.data(), (ptrdiff_t) values.size()});
+	}
+	else {
+		for (size_t i = 0; i < leaves.size(); i++) values[i] = value_fn(*leaves[i]);
+	}
+
+	auto value = values.begin();
+	for (const Playout& playout : playouts) backup(playout, (playout.evaluation ? *playout.evaluation : *value++), vloss);
+	leave(slot);
+}
+
+void algorithm::Tree::descend(Playout& playout, const Root& root, int vloss)
+{
+	vector<Node*>& nodes = playout.nodes;
+	vector<int>& indices = playout.indices;
 
 	int depth = 0;
-	nodes.push_back(base.get());
-	float evaluation = 0.5;
+	nodes.push_back(root.node);
 
 	//int diagnostic = 0;
 	//for (Edge& ed : base->edges) diagnostic += ed.visits;
@@ -652,8 +1475,7 @@ void algorithm::Tree::search(bool t_update_prefetch)
 		
 		if (node.result()) {
 			node.increment_n(); //update without evaluation
-			evaluation = evaluate(*node.result());
-			depth -= 1; //do not further update node after break
+			playout.evaluation = evaluate(*node.result());
 			break;
 		}
 		
@@ -680,17 +1502,17 @@ void algorithm::Tree::search(bool t_update_prefetch)
 		//if (search_res) for (auto prediction : node.node_prefetch) if (*search_res == (int) prediction) predicted = true;
 		
 		if (!search_res) {
-			if (node.apos->legal_check()) {
-				node.m_result = make_optional<GameResult>(victory(!node.apos->pos().to_move()));
+			if (node.m_in_check) {
+				node.set_result(node.white_to_play ? GameResult::Black : GameResult::White);
 			}
 			else {
-				node.m_result = make_optional<GameResult>(GameResult::Draw);
+				node.set_result(GameResult::Draw);
 			}
 			continue; //evaluate then break
 		}
 		const int index = *search_res;
 		indices.push_back(index); 
-		node.data_mutex.lock();
+		node.add_virtual_loss(index, vloss);
 
 		//if (t_update_prefetch) {
 		//	update_prefetch(node);
@@ -703,146 +1525,423 @@ void algorithm::Tree::search(bool t_update_prefetch)
 		//	if (search_res && node.edges[*search_res].node) for (Edge& ed : node.edges[*search_res].node->edges) diagnostic += ed.visits;
 		//}
 		
-		auto& node_ptr = node.edges[index].node;
-		if (node_ptr) {
-			node.data_mutex.unlock();
-			depth += 1;
-			nodes.push_back(node_ptr.get());
-			continue;
-		}
-		else {
-			Move mv = node.apos->get_move(index);
-			unique_ptr<AnalysedPosition> new_apos;
-			if (false || mv.is_en_passant() || mv.is_castling() || mv.is_promotion()) { //true to disable experimental move generation
-				new_apos = make_unique<AnalysedPosition>(node.apos->get_move(index).apply());
+		Node* next = node.child(index);
+		if (!next) {
+			NodePtr expanded = expand(nodes, indices, root.apos, playout.leaf, true);
+			if (!expanded) break; //no room to keep it, the leaf is evaluated all the same
+			next = expanded.get();
+			if (!node.publish_child(index, expanded)) {
+				next = node.child(index); //another thread expanded the edge first, descend into its node instead
+				playout.leaf.reset();
 			}
-			else {
-				new_apos = make_unique<AnalysedPosition>(*node.apos);
-				new_apos->advance_by(mv.record());
-			}
-			if (new_apos->illegal_check()) {
-				node.data_mutex.unlock();
-				node.set_illegal(index);
-				indices.pop_back();
-				continue;
-			}
-			else {
-				node_ptr = make_unique<Node>(move(new_apos));;
-				node.data_mutex.unlock();
-				evaluation = value_fn(*node_ptr->apos);
-				break;
+			else if (playout.leaf) {
+				break; //evaluated by the caller, other playouts may pass through the node meanwhile
 			}
+			//a transposition already in the graph is descended into like any other child
 		}
-	}
-
-	for (int i = depth; i >= 0; i--) {
-		nodes[i]->update(indices.at(i), evaluation);
+		depth += 1;
+		nodes.push_back(next);
 	}
 
 	//if (diagnostic > 1000000000) cerr << "wow"; //check unlikely condition to prevent optimising out
 }
 
+void algorithm::Tree::backup(const Playout& playout, float evaluation, int vloss)
+{
+	//only the edges on this path are updated, a node shared through a transposition keeps the statistics of every
+	//path into it in the edges above it
+	for (int i = playout.indices.size() - 1; i >= 0; i--) {
+		playout.nodes[i]->update(playout.indices[i], evaluation, vloss);
+	}
+}
+
 algorithm::TreeEngine::TreeEngine(
 	const AnalysedPosition& t_apos,
 	function<float(const AnalysedPosition&)> t_value_fn,
 	function<float(const AnalysedPosition&, const Move&)> t_prior_fn,
-	float t_expl_c
-)	: m_tree(Tree(t_apos, t_value_fn, t_prior_fn, t_expl_c))
-{
-	shared_future<void> halt_future(halt_promise.get_future());
-
-	const auto constant_search = [&, halt_future] () {
-		while (halt_future.wait_for(std::chrono::milliseconds(0)) == std::future_status::timeout) {
-			if (should_pause()) {
-				unique_lock<mutex> lk(pause_mx);
-				pause_count++;
-				pause_cv.notify_all();
-				while (pause_bool) pause_cv.wait(lk);
-				pause_count--;
-				pause_cv.notify_all();
-			}
-			if (total_n() > 10000000) { //hacky "solution" to avoid running out of ram
-				this_thread::sleep_for(1ms);
-				continue;
-			}
-			for (int i = 0; i < 999; i++) m_tree.search(); //should be 1000
-			m_tree.search(true);
+	float t_expl_c,
+	int t_virtual_loss,
+	const ThreadOptions& t_threads
+)	: m_tree(t_apos, t_value_fn, t_prior_fn, t_expl_c), m_pool(t_threads)
+{
+	m_tree.virtual_loss = t_virtual_loss;
+	m_tree.set_memory_limit(m_memory_budget.load(memory_order_relaxed));
+	m_tree.reclaim_on([this](function<void()> task) {m_pool.submit(move(task));}); //frees share the search threads
+	resume();
+
+	cerr << "Initial fen: " << m_tree.base_apos().pos().as_fen() << endl;
+}
+
+namespace {
+	thread_local const ThreadPool* current_pool = nullptr; //the pool whose worker is running on this thread
+	thread_local int current_worker = -1;
+}
+
+algorithm::ThreadPool::ThreadPool(const ThreadOptions& t_threads)
+{
+	Expects(t_threads.count >= 0);
+	const int count = (t_threads.count > 0 ? t_threads.count : max(1u, thread::hardware_concurrency()));
+	for (int i = 0; i < count; i++) m_queues.push_back(make_unique<Queue>());
+	for (int i = 0; i < count; i++) {
+		m_threads.emplace_back([this, i]() {run(i);});
+		if (t_threads.cpus.empty()) continue;
+		const int cpu = t_threads.cpus[i % t_threads.cpus.size()];
+#ifdef __linux__
+		if (cpu >= CPU_SETSIZE) {
+			cerr << "WARNING: cpu " << cpu << " is beyond the affinity mask" << endl;
+			continue;
 		}
-	};
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(set), &set) != 0) {
+			cerr << "WARNING: could not pin worker thread " << i << " to cpu " << cpu << endl;
+		}
+#else
+		if (i == 0) cerr << "WARNING: thread pinning is not supported on this platform" << endl;
+#endif
+	}
+}
 
-	m_threads.emplace_back(constant_search);
-	m_threads.emplace_back(constant_search);
-	m_threads.emplace_back(constant_search);
-	m_threads.emplace_back(constant_search);
+algorithm::ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lk(m_mx);
+		m_halt = true;
+	}
+	m_cv.notify_all();
+	for (thread& t : m_threads) t.join();
+}
 
-	cerr << "Initial fen: " << m_tree.base->apos->pos().as_fen() << endl;
+void algorithm::ThreadPool::submit(Task task)
+{
+	const int queues = m_queues.size();
+	const int target = (current_pool == this ? current_worker : (int) (m_next.fetch_add(1, memory_order_relaxed) % queues));
+	{
+		//counted before it can be taken, so that m_unfinished never reaches zero early
+		lock_guard<mutex> lk(m_mx);
+		m_queued.fetch_add(1, memory_order_relaxed);
+		m_unfinished++;
+	}
+	{
+		Queue& queue = *m_queues[target];
+		lock_guard<mutex> lk(queue.mx);
+		queue.tasks.push_back(move(task));
+	}
+	m_cv.notify_one();
 }
 
-const Move algorithm::TreeEngine::choose_move()
+void algorithm::ThreadPool::wait_idle()
 {
-	return m_tree.base->best_move();
+	unique_lock<mutex> lk(m_mx);
+	m_idle_cv.wait(lk, [this]() {return m_unfinished == 0;});
 }
 
-bool algorithm::TreeEngine::advance_to(const string& fen)
+bool algorithm::ThreadPool::take(int self, Task& task)
 {
-	pause();
-	unique_ptr<Node>* next_ptr = m_tree.base->find_child(fen);
-	if (next_ptr) {
-		m_tree.base = move(*next_ptr);
-		resume();
+	//in order from its own queue, so a task that requeues itself cannot starve the ones queued before it, and from
+	//the opposite end of the others' to keep away from their owners
+	const int queues = m_queues.size();
+	for (int k = 0; k < queues; k++) {
+		Queue& queue = *m_queues[(self + k) % queues];
+		lock_guard<mutex> lk(queue.mx);
+		if (queue.tasks.empty()) continue;
+		if (k == 0) {
+			task = move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		else {
+			task = move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		m_queued.fetch_sub(1, memory_order_relaxed);
 		return true;
 	}
-	else {
-		resume();
-		return false;
+	return false;
+}
+
+void algorithm::ThreadPool::run(int self)
+{
+	current_pool = this;
+	current_worker = self;
+	Task task;
+	while (true) {
+		if (take(self, task)) {
+			task();
+			task = nullptr; //release what it captured before it counts as finished
+			lock_guard<mutex> lk(m_mx);
+			if (--m_unfinished == 0) m_idle_cv.notify_all();
+			continue;
+		}
+		unique_lock<mutex> lk(m_mx);
+		if (m_halt && m_queued.load(memory_order_relaxed) == 0) break;
+		m_cv.wait(lk, [this]() {return m_halt || m_queued.load(memory_order_relaxed) > 0;});
 	}
+	current_pool = nullptr;
+	current_worker = -1;
 }
 
-bool algorithm::TreeEngine::advance_by(const Move& mv)
+optional<vector<int>> algorithm::parse_cpu_list(const string& list)
 {
-	pause();
-	unique_ptr<Node>* next_ptr = m_tree.base->find_child(mv);
-	if (next_ptr) {
-		m_tree.base = move(*next_ptr);
-		resume();
+	vector<int> cpus;
+	stringstream ss(list);
+	string item;
+	while (getline(ss, item, ',')) {
+		const size_t dash = item.find('-');
+		try {
+			size_t used = 0;
+			const int first = stoi(item.substr(0, dash), &used);
+			if (used != min(dash, item.size())) return nullopt;
+			int last = first;
+			if (dash != string::npos) {
+				last = stoi(item.substr(dash + 1), &used);
+				if (used != item.size() - dash - 1) return nullopt;
+			}
+			if (first < 0 || last < first) return nullopt;
+			for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+		}
+		catch (const logic_error&) { //invalid_argument or out_of_range from stoi
+			return nullopt;
+		}
+	}
+	if (cpus.empty()) return nullopt;
+	return cpus;
+}
+
+optional<ThreadOptions> algorithm::parse_thread_options(vector<string>& args)
+{
+	ThreadOptions options;
+	for (size_t i = 0; i < args.size();) {
+		if (args[i] != "--threads" && args[i] != "--cpus") {
+			i++;
+			continue;
+		}
+		if (i + 1 == args.size()) return nullopt;
+		if (args[i] == "--threads") {
+			const string& value = args[i + 1];
+			if (value.empty() || value.size() > 4 || value.find_first_not_of("0123456789") != string::npos) return nullopt;
+			options.count = stoi(value);
+		}
+		else {
+			optional<vector<int>> cpus = parse_cpu_list(args[i + 1]);
+			if (!cpus) return nullopt;
+			options.cpus = move(*cpus);
+		}
+		args.erase(args.begin() + i, args.begin() + i + 2);
+	}
+	return options;
+}
+
+const Move algorithm::TreeEngine::choose_move()
+{
+	return m_tree.best_move();
+}
+
+optional<chrono::milliseconds> algorithm::allocate_time(const SearchLimits& limits)
+{
+	if (limits.move_time) return *limits.move_time;
+	if (!limits.time_left) return nullopt;
+	constexpr chrono::milliseconds overhead = 50ms; //for the moves to reach the server
+	constexpr int sudden_death_moves = 30; //the game is assumed to last this many more moves
+	const chrono::milliseconds left = max(*limits.time_left - overhead, 0ms);
+	const int moves = (limits.moves_to_go > 0 ? limits.moves_to_go : sudden_death_moves);
+	return min(left / moves + limits.increment * 3 / 4, left * 3 / 4);
+}
+
+algorithm::XboardClock::XboardClock(chrono::milliseconds default_move_time)
+{
+	m_limits.move_time = default_move_time;
+}
+
+bool algorithm::XboardClock::command(const string& line)
+{
+	stringstream ss(line);
+	string word;
+	ss >> word;
+	if (word == "time") { //our clock in centiseconds, sent before each go
+		int centiseconds = 0;
+		if (!(ss >> centiseconds)) return false;
+		m_limits.time_left = chrono::milliseconds(10 * centiseconds);
+		if (!m_fixed) m_limits.move_time.reset(); //drops the default
 		return true;
 	}
-	else {
-		resume();
-		return false;
+	if (word == "st") { //fixed seconds per move
+		int seconds = 0;
+		if (!(ss >> seconds) || seconds <= 0) return false;
+		m_limits.move_time = chrono::seconds(seconds);
+		m_fixed = true;
+		return true;
+	}
+	if (word == "level") { //moves per time control, base time as minutes or minutes:seconds, increment in seconds
+		int moves = 0;
+		string base;
+		double increment = 0.0;
+		if (!(ss >> moves >> base >> increment) || moves < 0 || increment < 0.0) return false;
+		int minutes = 0;
+		int seconds = 0;
+		char colon = ':';
+		stringstream base_ss(base);
+		if (!(base_ss >> minutes) || (base_ss >> colon && (colon != ':' || !(base_ss >> seconds)))) return false;
+		m_limits.time_left = chrono::minutes(minutes) + chrono::seconds(seconds);
+		m_limits.increment = chrono::milliseconds(static_cast<int>(1000 * increment));
+		m_limits.moves_to_go = m_session_moves = moves;
+		m_limits.move_time.reset();
+		m_fixed = false;
+		return true;
 	}
+	return false;
+}
+
+void algorithm::XboardClock::move_played()
+{
+	if (m_session_moves == 0) return;
+	if (--m_limits.moves_to_go == 0) m_limits.moves_to_go = m_session_moves; //the next control starts
+}
+
+const Move algorithm::TreeEngine::search_until(const SearchLimits& limits)
+{
+	typedef chrono::steady_clock clock;
+	const clock::time_point start = clock::now();
+	const optional<chrono::milliseconds> budget = allocate_time(limits);
+	Expects(budget || limits.nodes || limits.playouts);
+	Expects(m_tree.base->edges_num() > 0);
+	if (m_tree.base->edges_num() == 1) return choose_move(); //nothing to decide
+
+	//virtual loss is left out, it would count playouts that are still descending
+	const int start_n = completed_n();
+	while (true) {
+		const int n = completed_n();
+		const int played = n - start_n;
+		const chrono::duration<double, milli> elapsed = clock::now() - start;
+
+		//playouts still to come under the tightest limit, time is converted at the rate seen so far
+		constexpr int settle = 100; //playouts before the rate and the gap are trusted
+		double left = INFINITY;
+		if (limits.nodes) left = min(left, (double) (*limits.nodes - n));
+		if (limits.playouts) left = min(left, (double) (*limits.playouts - played));
+		if (budget) {
+			if (elapsed >= *budget) break;
+			if (played >= settle) left = min(left, played / elapsed.count() * (budget->count() - elapsed.count()));
+		}
+		if (left <= 0.0) break;
+
+		if (limits.early_stop && played >= settle) {
+			int best = 0;
+			int second = 0;
+			for (int i = 0; i < m_tree.base->edges_num(); i++) {
+				const int visits = m_tree.base->edge_visits(i);
+				if (visits > best) {
+					second = best;
+					best = visits;
+				}
+				else if (visits > second) second = visits;
+			}
+			if (best - second > left) break;
+		}
+		this_thread::sleep_for(1ms);
+	}
+	return choose_move();
+}
+
+bool algorithm::TreeEngine::advance_to(const string& fen)
+{
+	return advance_to(Position(fen));
 }
+
+bool algorithm::TreeEngine::advance_to(const Position& pos)
+{
+	//the search carries on, switching to the new base as each playout starts
+	shared_lock<shared_mutex> lk(m_search_mx); //only excludes pruning
+	return m_tree.advance_to(pos);
+}
+
+bool algorithm::TreeEngine::advance_by(const Move& mv)
+{
+	shared_lock<shared_mutex> lk(m_search_mx);
+	return m_tree.advance_by(mv);
+}
+void algorithm::TreeEngine::set_virtual_loss(int t_virtual_loss)
+{
+	Expects(t_virtual_loss >= 0);
+	pause();
+	m_tree.virtual_loss = t_virtual_loss;
+	resume();
+}
+
+void algorithm::TreeEngine::set_compact_nodes(bool t_compact, int t_full_depth)
+{
+	Expects(t_full_depth >= 0);
+	pause();
+	m_tree.compact = t_compact;
+	m_tree.full_depth = t_full_depth;
+	resume();
+}
+
+void algorithm::TreeEngine::set_batch_evaluation(function<void(gsl::span<const AnalysedPosition*>, gsl::span<float>)> t_batch_value_fn, int t_batch_size)
+{
+	Expects(t_batch_size >= 1);
+	pause();
+	m_tree.batch_value_fn = t_batch_value_fn;
+	m_batch_size = t_batch_size;
+	resume();
+}
+
+void algorithm::TreeEngine::set_memory_budget(size_t bytes)
+{
+	m_memory_budget.store(bytes, memory_order_relaxed);
+	m_tree.set_memory_limit(bytes);
+}
+
 string algorithm::TreeEngine::display() const
 {
 	stringstream output;
-	output << "FEN: " << m_tree.base->apos->pos().as_fen() << endl;
-	output << (string) m_tree.base->apos->pos();
-	output << "Best move: " << m_tree.base->best_move() << endl;
+	output << "FEN: " << m_tree.base_apos().pos().as_fen() << endl;
+	output << (string) m_tree.base_apos().pos();
+	output << "Best move: " << m_tree.best_move() << endl;
 	output << endl;
 	output << m_tree.base->display();
 	return output.str();
 }
 
-bool algorithm::TreeEngine::should_pause()
+void algorithm::TreeEngine::search_task(CancellationToken token)
 {
-	lock_guard<mutex> lk(pause_mx);
-	return pause_bool;
+	if (!token.cancelled()) {
+		//the tree reserves nothing past the budget, so once a node finds no room in the slabs already held the tree
+		//is pruned to a margin below what is in use, or below the budget if that is less
+		if (m_tree.starved()) {
+			unique_lock<shared_mutex> lk(m_search_mx); //waits for the other tasks to finish their batches
+			const size_t budget = m_memory_budget.load(memory_order_relaxed);
+			if (m_tree.starved()) m_tree.prune(min(m_tree.memory_live(), budget) / 8 * prune_eighths);
+		}
+		//the token is checked on every playout, a relaxed load, so that pausing waits for one playout at most
+		shared_lock<shared_mutex> lk(m_search_mx);
+		if (m_batch_size > 1) {
+			for (int i = 0; i < 1000 && !token.cancelled(); i += m_batch_size) m_tree.search_batch(m_batch_size);
+		}
+		else {
+			for (int i = 0; i < 1000 && !token.cancelled(); i++) m_tree.search(i == 999);
+		}
+	}
+	if (token.cancelled()) {
+		lock_guard<mutex> lk(pause_mx);
+		if (--m_search_tasks == 0) pause_cv.notify_all();
+		return;
+	}
+	m_pool.submit([this, token]() {search_task(token);}); //behind any frees queued meanwhile
 }
 
 void algorithm::TreeEngine::pause()
 {
 	unique_lock<mutex> lk(pause_mx);
-	pause_bool = true;
-	pause_count = 0;
-	//pause_cv.notify_all();
-	while (pause_count < (int) m_threads.size()) pause_cv.wait(lk);
+	m_search_token.cancel();
+	pause_cv.wait(lk, [this]() {return m_search_tasks == 0;});
 }
 
 void algorithm::TreeEngine::resume()
 {
-	unique_lock<mutex> lk(pause_mx);
-	pause_bool = false;
-	assert(pause_count == (int) m_threads.size());
-	pause_cv.notify_all();
-	while (pause_count > 0) pause_cv.wait(lk);
+	lock_guard<mutex> lk(pause_mx);
+	assert(m_search_tasks == 0);
+	m_search_token = CancellationToken();
+	m_search_tasks = m_pool.size();
+	for (int i = 0; i < m_pool.size(); i++) m_pool.submit([this, token = m_search_token]() {search_task(token);});
 }
\ No newline at end of file
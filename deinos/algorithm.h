@@ -4,68 +4,404 @@
 #include <vector>
 #include <array>
 #include <gsl/pointers>
+#include <gsl/span>
+#include <memory>
+#include <cstddef>
+#include <cstring>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include <variant>
 #include <functional>
 #include <string>
 #include <thread>
-#include <future>
 #include <condition_variable>
+#include <chrono>
+#include <deque>
 
 //memory consmption ideas:
 //can halve Move size by removing piece type tracking and putting boold inside promotion piece
 //can reduce AnalysedPosition size by doubling up control inside one byte
 //perhaps dynamically delete parts of the tree e.g. only positions and regenerate if necessary
-//deletion thread?
 
 //Other
 //use gsl::index in for loops?
 
 namespace algorithm {
+	//a position with the control maps of both sides, updated incrementally from the squares each move changes.
+	//full nodes keep one, AnalysedPosition adds the legal moves
+	class AnalysedBoard {
+	public:
+		constexpr AnalysedBoard() = default;
+		explicit AnalysedBoard(const chess::Position&);
+
+		struct Undo {
+			chess::Position::Undo position;
+			std::array<chess::HalfByteBoard, 2> control; //from before the move, copied back rather than recalculated
+		};
+		void advance_by(chess::MoveRecord);
+		Undo make_move(chess::MoveRecord); //as advance_by, but the move can be taken back
+		void unmake_move(const Undo&);
+
+		inline const chess::Position& pos() const {return m_position;}
+		inline uint8_t ctrl(chess::Almnt a, chess::Square s) const {return m_control[chess::as_index(a)].get(s.file(), s.rank());}
+		inline int ctrl_sum(chess::Almnt a, chess::Bitboard squares) const {return m_control[chess::as_index(a)].sum(squares);}
+		inline int ctrl_count(chess::Almnt a, chess::Bitboard squares) const //number of the squares controlled at least once
+		{
+			return chess::popcount(m_control[chess::as_index(a)].nonzero() & squares);
+		}
+		inline int ctrl_difference() const {return m_control[0].sum() - m_control[1].sum();} //white control less black control
+		inline const chess::Square king_sq(chess::Almnt a) const
+		{
+			const chess::Bitboard kings = pos().pieces(a, chess::Piece::Type::King);
+			return (kings ? chess::all_squares[chess::lsb(kings)] : chess::Square());
+		}
+		inline bool in_check(chess::Almnt a) const {return ctrl(!a, king_sq(a)) > 0;}
+		inline bool legal_check() const {return in_check(pos().to_move());}
+		inline bool illegal_check() const {return in_check(!pos().to_move());}
+
+	private:
+		void add_control(chess::Almnt a, chess::Bitboard squares, int delta);
+		void append_calculation(chess::Square start); //add the control of the piece on start (for initialisation)
+		chess::Bitboard dependants(chess::Bitboard changed) const;
+		void remove_calculation(chess::Bitboard squares);
+		void append_dependants(chess::Bitboard changed);
+		chess::Position m_position;
+		std::array<chess::HalfByteBoard, 2> m_control;
+	};
+	static_assert(sizeof(AnalysedBoard) == sizeof(chess::Position) + 2 * sizeof(chess::HalfByteBoard));
+
 	class AnalysedPosition{
 	public:
 		constexpr AnalysedPosition() = default;
 		explicit AnalysedPosition(const chess::Position&); //generate from scratch
+		explicit AnalysedPosition(const AnalysedBoard&); //generates only the moves
 
+		struct Undo {
+			AnalysedBoard::Undo board;
+			chess::MoveList moves; //only the moves in use are copied
+		};
 		void advance_by(chess::MoveRecord);
+		Undo make_move(chess::MoveRecord); //as advance_by, but the move can be taken back
+		void unmake_move(const Undo&); //restores the position before the move exactly, moves in the same order
 		struct occlusion_info {
 			std::array<std::array<chess::Square, 16>, 2> squares;
 			std::array<int, 2> counts = {0};
 		};
 		AnalysedPosition::occlusion_info get_occlusion(chess::MoveRecord);
 
-		inline const chess::Position& pos() const {return m_position;}
-		inline uint8_t ctrl(chess::Almnt a, chess::Square s) const {return m_control[chess::as_index(a)].get(s.file(), s.rank());}
-		inline const std::vector<chess::MoveRecord>& moves(chess::Almnt a) const {return m_moves[chess::as_index(a)];}
-		inline const std::vector<chess::MoveRecord>& moves() const {return moves(pos().to_move());}
-		inline chess::Move get_move(int index) const {return chess::Move(pos(), moves().at(index));}
-		inline const chess::Square king_sq(chess::Almnt a) const {return m_king_sq[chess::as_index(a)];}
-		inline bool in_check(chess::Almnt a) const {return ctrl(!a, king_sq(a)) > 0;}
-		inline bool legal_check() const {return in_check(pos().to_move());}
-		inline bool illegal_check() const {return in_check(!pos().to_move());}
+		inline const AnalysedBoard& board() const {return m_board;}
+		inline const chess::Position& pos() const {return m_board.pos();}
+		inline uint8_t ctrl(chess::Almnt a, chess::Square s) const {return m_board.ctrl(a, s);}
+		inline int ctrl_sum(chess::Almnt a, chess::Bitboard squares) const {return m_board.ctrl_sum(a, squares);}
+		inline int ctrl_count(chess::Almnt a, chess::Bitboard squares) const {return m_board.ctrl_count(a, squares);}
+		inline int ctrl_difference() const {return m_board.ctrl_difference();}
+		void order_moves(); //put the legal moves in StagedMoves order: captures and promotions, checks, then the rest
+		//legal moves for the side to move, the other side's moves are not kept
+		inline gsl::span<const chess::MoveRecord> moves() const {return {m_moves.data(), static_cast<std::ptrdiff_t>(m_moves.size())};}
+		inline chess::Move get_move(int index) const {Expects(index >= 0 && index < moves().size()); return chess::Move(pos(), moves()[index]);}
+		inline const chess::Square king_sq(chess::Almnt a) const {return m_board.king_sq(a);}
+		inline bool in_check(chess::Almnt a) const {return m_board.in_check(a);}
+		inline bool legal_check() const {return m_board.legal_check();}
+		inline bool illegal_check() const {return m_board.illegal_check();}
 		std::optional<chess::Move> find_record(const std::string& name) const;
 		friend std::ostream& operator<<(std::ostream& os, const AnalysedPosition& ap);
 		
 	private:
-		void append_calculation(chess::Square start); //calculate data associated with this square and append to state (for initialisation)
+		void generate_moves(); //the legal moves of the side to move, once control is up to date
 		void append_castling();
-		std::array<chess::Square, 2> m_king_sq;
-		chess::Position m_position;
-		std::array<chess::HalfByteBoard, 2> m_control;
-		std::array<std::vector<chess::MoveRecord>, 2> m_moves = {};
+		AnalysedBoard m_board;
+		chess::MoveList m_moves;
 	};
+	static_assert(sizeof(AnalysedPosition) <= 640, "kept by every search thread and leaf in a batch");
 	std::ostream& operator<<(std::ostream& os, const AnalysedPosition& ap);
 
+	//Classifies pseudo-legal moves of the side to move in a position, which must outlive it
+	class MoveClassifier {
+	public:
+		explicit MoveClassifier(const chess::Position&, bool with_checks = true); //without checks, gives_check is always false
+		bool legal(chess::MoveRecord) const; //castling is assumed to have been checked for attacked squares
+		bool capture(chess::MoveRecord) const; //including en passant and promotions
+		bool gives_check(chess::MoveRecord) const; //directly or by discovery, ignoring castling rooks
+		chess::Bitboard check_targets(chess::Square start) const; //a superset of the squares the piece on start can check from
+		chess::Bitboard legal_targets(chess::Square start, chess::Bitboard targets) const; //of the piece on start, from pseudo-legal ones
+		inline bool in_check() const {return m_checkers != 0;}
+	private:
+		const chess::Position* m_position;
+		chess::Square m_king_sq;
+		bool m_has_king;
+		chess::Bitboard m_checkers = 0;
+		chess::Bitboard m_evasion = ~chess::Bitboard{0}; //squares a non-king move must land on
+		chess::Bitboard m_pinned = 0;
+		std::array<chess::Bitboard, 7> m_check_squares = {0}; //by piece type, where it would attack the enemy king
+		chess::Bitboard m_discoverers = 0; //own pieces whose move can uncover a check
+		chess::Square m_enemy_king_sq;
+	};
+
+	//Legal moves of a position generated lazily, a stage at a time: captures and promotions, checks, then quiet moves
+	//(castling counts as quiet)
+	class StagedMoves {
+	public:
+		enum class Stage : uint8_t {Captures, Checks, Quiets, Done};
+		explicit StagedMoves(const chess::Position&); //the position must outlive the generator
+		std::optional<chess::MoveRecord> next(); //generates the next stage when the current one is used up
+		inline Stage stage() const {return m_current;} //of the move last returned
+	private:
+		void generate(Stage);
+		const chess::Position* m_position;
+		MoveClassifier m_classifier;
+		chess::MoveList m_moves;
+		std::size_t m_next = 0;
+		Stage m_current = Stage::Captures;
+		Stage m_pending = Stage::Captures;
+	};
+
+	//bytes held by the node pool and transposition table of a tree, charged before they are reserved so that the
+	//total can be kept within a limit. nothing is given back until the tree is destroyed
+	class MemoryAccount {
+	public:
+		bool charge(size_t bytes); //false, charging nothing, if the total would pass the limit
+		inline void force(size_t bytes) {m_held.fetch_add(bytes, std::memory_order_relaxed);} //whatever the limit
+		inline size_t held() const {return m_held.load(std::memory_order_relaxed);}
+		inline void set_limit(size_t bytes) {m_limit.store(bytes, std::memory_order_relaxed);}
+	private:
+		std::atomic<size_t> m_held{0};
+		std::atomic<size_t> m_limit{SIZE_MAX};
+	};
+
+	//slab allocator for the search tree: a node, its position and its edges share one cache line aligned block.
+	//threads carve blocks from their own shard. slabs are never returned, so a freed block is handed out again
+	//before another slab is reserved: first from the shard's own free lists, then from any other shard's, taking
+	//the smallest free block that fits and keeping the rest of it free. merge_free joins the pieces up again
+	class NodePool {
+	public:
+		static constexpr size_t granularity = 64; //block sizes are rounded up to whole cache lines
+		static constexpr size_t slab_size = 1 << 20;
+
+		struct Block {
+			void* address;
+			size_t bytes;
+		};
+
+		explicit NodePool(MemoryAccount* account = nullptr); //charged for each slab, unlimited without one
+		NodePool(const NodePool&) = delete;
+		NodePool& operator=(const NodePool&) = delete;
+
+		//a limited allocation returns nullptr rather than reserve a slab past the limit of the account
+		void* allocate(size_t bytes, bool limited = false);
+		void deallocate(gsl::span<const Block> blocks); //takes each shard lock once per call
+		void merge_free(); //joins adjacent free blocks, whichever shards list them. takes every shard lock
+		inline size_t reserved_bytes() const {return m_reserved.load(std::memory_order_relaxed);} //held in slabs, in use or not
+		inline size_t used_bytes() const {return m_used.load(std::memory_order_relaxed);} //blocks handed out, as rounded
+
+	private:
+		struct alignas(granularity) CacheLine {std::byte bytes[granularity];};
+		struct FreeBlock {
+			FreeBlock* next;
+			size_t lines;
+		};
+		//wider than any node of a reachable position, blocks from this size on share the last list
+		static constexpr size_t large_lines = 128;
+		struct Shard {
+			mutable std::mutex mx;
+			std::vector<std::unique_ptr<CacheLine[]>> slabs;
+			CacheLine* cursor = nullptr;
+			CacheLine* end = nullptr;
+			std::array<FreeBlock*, large_lines + 1> free_lists = {}; //indexed by size in cache lines
+			std::atomic<size_t> free_lines{0}; //read unlocked to skip shards with nothing to offer
+		};
+
+		Shard& local_shard();
+		static void push_free(Shard& shard, void* address, size_t lines);
+		void* take_free(Shard& shard, size_t lines); //the shard must be locked
+
+		std::vector<std::unique_ptr<Shard>> m_shards;
+		MemoryAccount* const m_account;
+		std::atomic<size_t> m_used{0};
+		std::atomic<size_t> m_reserved{0};
+	};
+
 	class Node;
+
+	struct NodeDeleter { //drops one reference, returning every node no longer referenced to its pool
+		void operator()(Node* node) const;
+	};
+	typedef std::unique_ptr<Node, NodeDeleter> NodePtr; //one counted reference to a node
+
+	//the position hash combined with the ply, so that a position recurring later in a line gets a new node and the
+	//search graph stays acyclic
+	inline uint64_t transposition_key(const chess::Position& pos)
+	{
+		const uint64_t ply = 2 * pos.fm_count() + (pos.to_move() == chess::Almnt::Black);
+		return pos.hash() ^ (ply * 0x9E3779B97F4A7C15);
+	}
+
+	//concurrent map from transposition key to the node holding that position, chained through the nodes.
+	//references to a listed node are only taken and dropped under its shard lock, so a node cannot be released
+	//between being found here and being linked to an edge
+	class TranspositionTable {
+	public:
+		explicit TranspositionTable(MemoryAccount* account = nullptr); //charged as the buckets grow
+		TranspositionTable(const TranspositionTable&) = delete;
+		TranspositionTable& operator=(const TranspositionTable&) = delete;
+
+		NodePtr acquire(uint64_t key); //a new reference to the node listed under key, nullptr if there is none
+		bool insert(NodePtr& node); //lists node, or if a node already holds its key replaces node with a reference to it
+		size_t size() const;
+		size_t bucket_bytes() const;
+
+	private:
+		struct Shard {
+			mutable std::mutex mx;
+			std::vector<Node*> buckets;
+			size_t count = 0;
+		};
+		static constexpr int shard_bits = 6;
+
+		inline Shard& shard(uint64_t key) {return m_shards[key & ((1 << shard_bits) - 1)];}
+		static size_t bucket(const Shard& shard, uint64_t key) {return (key >> shard_bits) & (shard.buckets.size() - 1);}
+		void grow(Shard& shard); //unless the account has no room, leaving the chains longer instead
+		bool release(Node* node); //drops a reference, unlisting the node if it was the last one
+
+		std::array<Shard, 1 << shard_bits> m_shards;
+		MemoryAccount* const m_account;
+
+		friend struct NodeDeleter;
+	};
+
+	struct ThreadOptions {
+		int count = 0; //worker threads, 0 for one per hardware thread
+		std::vector<int> cpus; //thread i is pinned to cpus[i % cpus.size()], empty leaves the threads unpinned
+	};
+	//a comma separated list of cpus and ranges such as "0-3,8", nullopt if it is malformed
+	std::optional<std::vector<int>> parse_cpu_list(const std::string& list);
+	//removes "--threads N" and "--cpus LIST" from command line arguments, nullopt if either value is malformed
+	std::optional<ThreadOptions> parse_thread_options(std::vector<std::string>& args);
+
+	//shared by a task and whoever may stop it, the task polls it between units of work. copies share one flag
+	class CancellationToken {
+	public:
+		CancellationToken() : m_cancelled(std::make_shared<std::atomic<bool>>(false)) {}
+		inline void cancel() {m_cancelled->store(true, std::memory_order_relaxed);}
+		inline bool cancelled() const {return m_cancelled->load(std::memory_order_relaxed);}
+
+	private:
+		std::shared_ptr<std::atomic<bool>> m_cancelled;
+	};
+
+	//work-stealing pool: each worker takes tasks from the front of its own queue and steals from the back of the
+	//others' when it runs out. tasks submitted from a worker go to its own queue, others are spread round robin
+	class ThreadPool {
+	public:
+		typedef std::function<void()> Task;
+
+		explicit ThreadPool(const ThreadOptions& threads = {});
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		~ThreadPool(); //runs every queued task, tasks that requeue themselves must be cancelled first
+
+		void submit(Task task);
+		void wait_idle(); //until every task submitted so far, and any they submitted, has finished
+		inline int size() const {return m_threads.size();}
+
+	private:
+		struct Queue {
+			std::mutex mx;
+			std::deque<Task> tasks;
+		};
+
+		bool take(int self, Task& task); //from its own queue, then from the others
+		void run(int self);
+
+		std::vector<std::unique_ptr<Queue>> m_queues;
+		std::mutex m_mx; //idle workers sleep on m_cv, wait_idle callers on m_idle_cv
+		std::condition_variable m_cv;
+		std::condition_variable m_idle_cv;
+		std::atomic<int> m_queued{0};
+		int m_unfinished = 0; //guarded by m_mx
+		std::atomic<unsigned int> m_next{0};
+		bool m_halt = false;
+		std::vector<std::thread> m_threads;
+	};
+
+	//frees discarded subtrees on a thread of its own, started when the first one arrives, or as tasks on an
+	//executor such as a ThreadPool, so that dropping the old base after a move does not stall the search
+	class Reclaimer {
+	public:
+		Reclaimer() = default;
+		Reclaimer(const Reclaimer&) = delete;
+		Reclaimer& operator=(const Reclaimer&) = delete;
+		~Reclaimer(); //frees whatever is still queued before returning
+
+		void discard(NodePtr node);
+		void wait_idle(); //until every subtree discarded so far has been freed
+		void set_executor(std::function<void(std::function<void()>)> executor); //before the first discard
+
+	private:
+		void run();
+		void drain(); //frees until the queue is empty, run as a task on the executor
+
+		std::mutex m_mx;
+		std::condition_variable m_cv;
+		std::vector<NodePtr> m_queue;
+		bool m_busy = false;
+		bool m_halt = false;
+		bool m_scheduled = false; //a drain is queued on the executor
+		std::function<void(std::function<void()>)> m_executor;
+		std::thread m_thread;
+	};
 	
-	struct Edge {
-		//std::mutex ptr_mutex;
-		float total_value;
-		int visits = 0;
-		//bool legal = true;
-		inline bool legal() const {return visits != -1;}
-		std::unique_ptr<Node> node = nullptr;
+	//edge statistics of a node as parallel arrays, so that selection can score several edges per instruction.
+	//visits and values are plain words, so that they can be loaded as vectors, but every other access goes through
+	//the relaxed __atomic builtins below. children are published by compare and swap
+	struct EdgeArrays {
+		static constexpr int lanes = 8; //the statistic arrays are padded to a multiple of this
+		static constexpr int padded(int n) {return (n + lanes - 1) / lanes * lanes;}
+
+		inline int32_t visit_count(int i) const {return __atomic_load_n(visits + i, __ATOMIC_RELAXED);}
+		inline float value(int i) const
+		{
+			float out;
+			__atomic_load(values + i, &out, __ATOMIC_RELAXED);
+			return out;
+		}
+		inline void add_visits(int i, int32_t delta) {__atomic_fetch_add(visits + i, delta, __ATOMIC_RELAXED);}
+		inline void add_value(int i, float delta)
+		{
+			float expected = value(i);
+			float desired;
+			do desired = expected + delta;
+			while (!__atomic_compare_exchange(values + i, &expected, &desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		}
+
+		int size = 0;
+		int32_t* visits = nullptr;
+		float* values = nullptr; //sums of evaluations from white's point of view
+		uint16_t* priors = nullptr; //exploration weights as bfloat16, scaled so that their mean is 1
+		std::atomic<Node*>* children = nullptr; //owned, released with the node
 	};
+	static_assert(__atomic_always_lock_free(sizeof(int32_t), 0) && __atomic_always_lock_free(sizeof(float), 0));
+	static_assert(std::atomic<Node*>::is_always_lock_free);
+
+	//a bfloat16 is the upper half of a float, so priors widen back to floats with a shift and no conversion unit
+	inline uint16_t pack_prior(float prior)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &prior, sizeof(bits));
+		return static_cast<uint16_t>((bits + 0x7fff + ((bits >> 16) & 1)) >> 16); //round to nearest even
+	}
+	inline float unpack_prior(uint16_t packed)
+	{
+		const uint32_t bits = static_cast<uint32_t>(packed) << 16;
+		float prior;
+		std::memcpy(&prior, &bits, sizeof(prior));
+		return prior;
+	}
+
+	//index of the edge maximising q + explore * prior / (1 + visits), where q is the mean value for the side to
+	//move; ties go to the lowest index. 8 edges are scored at a time with AVX2, 4 with SSE2
+	int select_edge(const EdgeArrays& edges, bool white_to_play, float explore);
+	float value_sum(const EdgeArrays& edges);
 
 	struct EdgeDatum {
 		float total_value = 0.0;
@@ -81,57 +417,168 @@ namespace algorithm {
 
 	class Node { //TODO
 	public:
-		explicit Node(std::unique_ptr<const AnalysedPosition> t_apos);
-		explicit Node(const AnalysedPosition& t_apos);
+		//both kinds keep the moves after the edge statistics, a full node also copies the board of t_apos into its block.
+		//nullptr if limited and the pool has no room, see NodePool::allocate
+		static NodePtr create(NodePool& pool, const AnalysedPosition& t_apos, bool compact = false, bool limited = false);
+		Node(const Node&) = delete;
+		Node& operator=(const Node&) = delete;
+
 		int preferred_index();
-		std::unique_ptr<Node>* find_child(const std::string& fen);
-		std::unique_ptr<Node>* find_child(const chess::Move& mv);
-		inline Node* child(int index) const {return edges[index].node.get();}
-		const chess::Move best_move() {return chess::Move(apos->pos(), apos->moves()[preferred_index()]);}
-		inline std::optional<chess::GameResult> result() const {return m_result;}
+		Node* find_child(const chess::Position& pos); //ignoring en passant targets
+		Node* find_child(const std::string& fen);
+		Node* find_child(const chess::Move& mv);
+		NodePtr detach_child(const Node* child); //transfers ownership of a child found above, nullptr if not a child
+		inline Node* child(int index) const {return edges.children[index].load(std::memory_order_acquire);}
+		inline const chess::MoveRecord& edge_move(int index) const {return m_moves[index];}
+		inline int edges_num() const {return edges.size;}
+		inline int edge_visits(int index) const {return edges.visit_count(index);}
+		const chess::Move best_move() {Expects(board); return chess::Move(board->pos(), edge_move(preferred_index()));}
+		inline std::optional<chess::GameResult> result() const {return m_result.load(std::memory_order_relaxed);}
 		//inline int res_dist() const {return m_res_dist;} //TODO
 		std::string display() const;
 
-		inline int total_n() const {return m_total_n;} //synchronise?
+		//visits including the virtual loss of searches still descending, as selection sees them
+		inline int total_n() const
+		{
+			const uint64_t visits = m_visits.load(std::memory_order_relaxed);
+			return static_cast<int>((visits & 0xffffffff) + (visits >> 32));
+		}
+		inline int completed_n() const {return static_cast<int>(m_visits.load(std::memory_order_relaxed) & 0xffffffff);}
 		
-		const std::unique_ptr<const AnalysedPosition> apos;
+		const AnalysedBoard* const board; //stored directly after the node, nullptr for a compact node
 		const bool white_to_play;
 		
 	private:
-		void update(int index, float t_value);
+		Node(NodePool& t_pool, const AnalysedBoard* t_board, bool t_white_to_play, const EdgeArrays& t_edges);
+
+		void update(int index, float t_value, int t_virtual_loss = 0); //also withdraws a virtual loss from the descent
+		void add_virtual_loss(int index, int t_virtual_loss); //counts extra visits lost by the side to move
 		void increment_n();
-		void set_illegal(int index);
+		void set_result(chess::GameResult t_result) {m_result.store(t_result, std::memory_order_relaxed);}
+		bool publish_child(int index, NodePtr& t_child); //takes ownership unless another thread published first
 	
-		std::optional<chess::GameResult> m_result = std::nullopt;
+		NodePool& m_pool;
+		uint64_t m_key = 0; //transposition key
+		TranspositionTable* m_table = nullptr; //set while the node is listed
+		Node* m_next_entry = nullptr; //next node in the same table bucket
+		std::atomic<int> m_references{1}; //edges and roots holding the node
+		bool m_in_check = false;
+		std::atomic<std::optional<chess::GameResult>> m_result{std::nullopt};
 		//int m_res_dist = 0; //TODO
 		//std::mutex data_mutex2;
 		//EdgeData data;
-		int m_total_n = 1;
-		std::vector<Edge> edges;
+		std::atomic<uint64_t> m_visits{1}; //completed visits in the low half, virtual loss in the high half, read together
+		EdgeArrays edges; //stored directly after the position
+		const chess::MoveRecord* m_moves; //the move of each edge, stored after the children
 		//std::vector<Edge> edges2;
-		std::mutex data_mutex; //40B
 
 		std::array<uint8_t, 3> node_prefetch = {0};
 		
 		friend class Tree;
+		friend class TranspositionTable;
+		friend struct NodeDeleter;
 	};
 
 	class Tree {
+		std::unique_ptr<MemoryAccount> m_memory; //charged by the pool and the table
+		std::unique_ptr<NodePool> m_pool; //declared before the nodes so that it outlives them
+		std::unique_ptr<TranspositionTable> m_table;
+		std::unique_ptr<Reclaimer> m_reclaimer; //destroyed before the table and pool its subtrees return to
 	public:
 		Tree(const AnalysedPosition& base_apos, std::function<float(const AnalysedPosition&)> t_value_fn,
-			std::function<float(const AnalysedPosition&, const chess::Move&)> t_prior_fn, float t_expl_c = 0.2)			
-			: base(std::make_unique<Node>(base_apos)), value_fn(t_value_fn), prior_fn(t_prior_fn), expl_c(t_expl_c) {}
+			std::function<float(const AnalysedPosition&, const chess::Move&)> t_prior_fn, float t_expl_c = 0.2);
 		void search(bool update_prefetch = false);
-		std::unique_ptr<Node> base;
+		//size playouts whose new leaves are evaluated together by batch_value_fn, or one at a time by value_fn if it
+		//is unset, before any of them is backed up. at least one visit of virtual loss separates their paths
+		void search_batch(int size);
+		//make a child the new base, ignoring en passant targets. searches may run meanwhile, those still below the
+		//old base are waited for before it is discarded
+		bool advance_to(const chess::Position& pos);
+		bool advance_by(const chess::Move& mv);
+		const chess::Move best_move() const; //from the base
+		size_t memory_used() const; //bytes held: every slab reserved for nodes, in use or free, and the transposition table
+		size_t memory_live() const; //bytes of the nodes still in use and the transposition table
+		//searches create nodes only while memory_used() stays within bytes. one that finds no room evaluates its leaf
+		//all the same, without keeping it, and the tree is starved until the next prune
+		inline void set_memory_limit(size_t bytes) {m_memory->set_limit(bytes);}
+		inline bool starved() const {return m_starved.load(std::memory_order_relaxed);}
+		//frees the subtrees below the least visited edges until memory_live() is at most target, their statistics
+		//remain in the edges. the freed blocks are merged and reused before memory_used() grows again.
+		//must not run concurrently with search()
+		void prune(size_t target);
+		inline void wait_reclaimed() {m_reclaimer->wait_idle();} //for subtrees left behind by advance_to or advance_by
+		inline void reclaim_on(std::function<void(std::function<void()>)> executor) {m_reclaimer->set_executor(std::move(executor));}
+		inline const AnalysedPosition& base_apos() const {return m_base_apos;}
+		NodePtr base;
 		std::function<float(const AnalysedPosition&)> value_fn;
+		std::function<void(gsl::span<const AnalysedPosition*>, gsl::span<float>)> batch_value_fn; //fills one value per position
 		std::function<float(const AnalysedPosition&, const chess::Move&)> prior_fn;
 		float expl_c = 0.2; //exploration coefficient
+		int virtual_loss = 0; //visits counted as losses on each edge a search is descending through
+		//compact nodes drop their AnalysedPosition, which is rebuilt along the search path when a child is expanded.
+		//nodes created within full_depth plies of the base stay full so that rebuilds start close to the leaf
+		bool compact = false;
+		int full_depth = 3;
 
 	private:
-		float evaluate_node(Node& node); //used in search() for recursion
+		struct Root { //what searches start from, fixed for an epoch
+			Node* node = nullptr;
+			AnalysedPosition apos;
+		};
+		struct Playout {
+			std::vector<Node*> nodes;
+			std::vector<int> indices; //the edge taken from each node, none from a node where the game is over
+			std::optional<float> evaluation; //known without value_fn, the game is over
+			std::optional<AnalysedPosition> leaf; //otherwise the position of the newly expanded node
+		};
+
 		void update_node(int index, float t_value);
 		std::optional<int> edge_to_search(Node& node);
+		int enter(); //joins the current epoch, returning the slot of its root
+		void leave(int slot);
+		void publish_root(); //starts a new epoch from base, then waits for the searches of the old one to finish
+		void descend(Playout& playout, const Root& root, int vloss); //adds virtual loss along the path
+		void backup(const Playout& playout, float evaluation, int vloss); //withdraws it again
+		//the child for the last edge of a path, shared with transpositions. leaf holds its position if the child is
+		//new, or if it is limited and there was no room for it, when nullptr is returned
+		NodePtr expand(const std::vector<Node*>& nodes, const std::vector<int>& indices, const AnalysedPosition& base_apos,
+			std::optional<AnalysedPosition>& leaf, bool limited);
+		bool advance(int index);
+		void assign_priors(Node& node, const AnalysedPosition& apos) const; //before the node is shared
 		void update_prefetch(Node& node);
+
+		AnalysedPosition m_base_apos; //kept for when the base is a compact node
+		//the root of an epoch is rewritten two epochs later, once every search that entered it has left
+		std::array<Root, 2> m_roots;
+		std::atomic<uint64_t> m_epoch{0};
+		alignas(64) std::array<std::atomic<int>, 2> m_active = {}; //searches in the epochs of each slot
+		std::atomic<bool> m_starved{false};
+	};
+
+	struct SearchLimits {
+		std::optional<std::chrono::milliseconds> move_time; //for this move, overrides the clock
+		std::optional<std::chrono::milliseconds> time_left; //on the clock of the side to move, shared out by allocate_time
+		std::chrono::milliseconds increment{0};
+		int moves_to_go = 0; //before the next time control, 0 if the rest of the game must fit in time_left
+		std::optional<int> nodes; //completed visits of the base, including those carried over from earlier moves
+		std::optional<int> playouts; //started by this search
+		bool early_stop = true; //once the visits left cannot close the gap between the two most visited moves
+	};
+	//time to spend on the next move, nullopt if limits sets no time
+	std::optional<std::chrono::milliseconds> allocate_time(const SearchLimits& limits);
+
+	//the limits set by the time control commands of the xboard protocol. a fixed time per move from st holds until
+	//the next level, while time only updates the clock
+	class XboardClock {
+	public:
+		explicit XboardClock(std::chrono::milliseconds default_move_time); //until the interface sends a time control
+		bool command(const std::string& line); //false if the line is not a well formed level, st or time command
+		void move_played(); //counts down the moves left before the next time control
+		inline const SearchLimits& limits() const {return m_limits;}
+	private:
+		SearchLimits m_limits;
+		int m_session_moves = 0; //moves per time control, 0 when the rest of the game must fit in the clock
+		bool m_fixed = false; //st is in force
 	};
 
 	class TreeEngine {
@@ -140,12 +587,11 @@ namespace algorithm {
 			const AnalysedPosition& initial_position,
 			std::function<float(const AnalysedPosition&)> t_value_fn,
 			std::function<float(const AnalysedPosition&, const chess::Move&)> t_prior_fn,
-			float exploration_coefficient);
+			float exploration_coefficient,
+			int virtual_loss = 3,
+			const ThreadOptions& threads = {});
 
-		~TreeEngine() {
-			halt_promise.set_value();
-			for (auto& t : m_threads) t.join();
-		}
+		~TreeEngine() {pause();} //the pool then finishes any frees still queued
 
 		TreeEngine(const TreeEngine&) = delete;
 		TreeEngine& operator=(const TreeEngine&) = delete;
@@ -154,24 +600,41 @@ namespace algorithm {
 
 		//void start();
 		const chess::Move choose_move(); //maybe add exploration?
+		//blocks until one of the limits is reached, then chooses. at least one limit must be set
+		const chess::Move search_until(const SearchLimits& limits);
+		bool advance_to(const chess::Position& pos);
 		bool advance_to(const std::string& fen);
 		bool advance_by(const chess::Move& mv); //TODO
+		void set_virtual_loss(int virtual_loss); //steers concurrent searches apart, 0 disables it
+		void set_compact_nodes(bool compact, int full_depth = 3); //applies to nodes created from now on
+		void set_memory_budget(size_t bytes); //bounds memory_used(), the least visited subtrees are pruned to keep within it
+		//each thread evaluates batch_size leaves at a time through batch_value_fn, a batch_size of 1 evaluates
+		//every leaf as soon as it is expanded
+		void set_batch_evaluation(std::function<void(gsl::span<const AnalysedPosition*>, gsl::span<float>)> batch_value_fn, int batch_size);
+		inline size_t memory_used() const {return m_tree.memory_used();}
+		inline size_t memory_live() const {return m_tree.memory_live();}
 		std::string display() const; //TODO
 
 		inline int total_n() const {return m_tree.base->total_n();};
+		inline int completed_n() const {return m_tree.base->completed_n();}
+		inline int thread_count() const {return m_pool.size();}
 		
 	private:
-		bool should_pause();
-		void pause(); //blocks until all threads are paused
-		void resume(); //blocks until all threads are resumed
+		void pause(); //cancels the search tasks and blocks until they have all returned
+		void resume(); //queues one search task per pool thread
+		void search_task(CancellationToken token); //a batch of playouts, then requeues itself until cancelled
 	
+		static constexpr size_t prune_eighths = 7; //of the memory in use, kept by each prune
+
 		Tree m_tree;
-		std::promise<void> halt_promise;
+		int m_batch_size = 1; //only changed while paused
+		std::atomic<size_t> m_memory_budget{size_t(1) << 30};
+		std::shared_mutex m_search_mx; //held shared while searching, exclusively while pruning
+		CancellationToken m_search_token;
 		std::mutex pause_mx;
 		std::condition_variable pause_cv;
-		bool pause_bool = false;
-		int pause_count = 0;
-		std::vector<std::thread> m_threads;
+		int m_search_tasks = 0; //queued or running, guarded by pause_mx
+		ThreadPool m_pool; //declared last so that its threads stop before anything they use is destroyed
 	};
 }
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <stdexcept>
 #include <cmath>
+#include <cstring>
 #include <gsl/gsl_util>
 using namespace chess;
 using namespace std;
@@ -43,6 +44,117 @@ optional<Square> chess::Square::translate(int files,int ranks) const
 	return Square(static_cast<uint8_t>(new_file), static_cast<uint8_t>(new_rank));
 }
 
+std::array<Magic, 64> chess::tables::rook_magics;
+std::array<Magic, 64> chess::tables::bishop_magics;
+std::array<std::array<Bitboard, 64>, 64> chess::tables::between;
+std::array<std::array<Bitboard, 64>, 64> chess::tables::line;
+
+namespace {
+	//first of the four ray directions walked by each slider
+	constexpr int orthogonal = 0;
+	constexpr int diagonal = 1;
+
+	array<Bitboard, 0x19000> rook_table; //sum of 2^(relevant bits) over all squares
+	array<Bitboard, 0x1480> bishop_table;
+
+	//slow reference implementation used to fill the lookup tables
+	Bitboard sliding_attacks(int slider, Square s, Bitboard occupied)
+	{
+		Bitboard out = 0;
+		for (int dir = slider; dir < 8; dir += 2) {
+			for (Square new_s : ray(dir, s)) {
+				out |= square_bb(new_s);
+				if (occupied & square_bb(new_s)) break;
+			}
+		}
+		return out;
+	}
+
+	//xorshift64star, seeded per rank with values known to find magics quickly
+	class MagicRng {
+	public:
+		explicit MagicRng(uint64_t t_seed) : state(t_seed) {}
+		uint64_t sparse() {return next() & next() & next();}
+	private:
+		uint64_t next()
+		{
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			return state * 2685821657736338717ULL;
+		}
+		uint64_t state;
+	};
+
+	void init_magics(array<Magic, 64>& magics, Bitboard* table, int slider)
+	{
+		[[maybe_unused]] constexpr array<uint64_t, 8> seeds {728, 10316, 55013, 32803, 12281, 15100, 16645, 255};
+		vector<Bitboard> occupancy(4096);
+		vector<Bitboard> reference(4096);
+		vector<int> epoch(4096, 0);
+		[[maybe_unused]] int attempt = 0;
+		Bitboard* next_table = table;
+
+		for (Square s : all_squares) {
+			Magic& m = magics[s.index()];
+			const Bitboard edges = ((rank_bb(0) | rank_bb(7)) & ~rank_bb(s.rank())) |
+				((file_bb(0) | file_bb(7)) & ~file_bb(s.file()));
+			m.mask = sliding_attacks(slider, s, 0) & ~edges;
+			m.shift = 64 - popcount(m.mask);
+			m.attacks = next_table;
+
+			//enumerate every subset of the mask (carry-rippler)
+			int size = 0;
+			Bitboard b = 0;
+			do {
+				occupancy[size] = b;
+				reference[size] = sliding_attacks(slider, s, b);
+				size++;
+				b = (b - m.mask) & m.mask;
+			} while (b);
+			next_table += size;
+
+			Bitboard* const out = next_table - size;
+#ifdef __BMI2__
+			for (int i = 0; i < size; i++) out[m.index(occupancy[i])] = reference[i];
+#else
+			MagicRng rng(seeds[s.rank()]);
+			for (int i = 0; i < size;) {
+				m.magic = 0;
+				while (popcount((m.magic * m.mask) >> 56) < 6) m.magic = rng.sparse();
+				attempt++;
+				for (i = 0; i < size; i++) {
+					const unsigned index = m.index(occupancy[i]);
+					if (epoch[index] < attempt) {
+						epoch[index] = attempt;
+						out[index] = reference[i];
+					}
+					else if (out[index] != reference[i]) break;
+				}
+			}
+#endif
+		}
+	}
+
+	[[maybe_unused]] const bool tables_ready = []() {
+		init_magics(tables::rook_magics, rook_table.data(), orthogonal);
+		init_magics(tables::bishop_magics, bishop_table.data(), diagonal);
+		for (Square s1 : all_squares) {
+			for (Square s2 : all_squares) {
+				if (s1 == s2) continue;
+				for (int slider : {orthogonal, diagonal}) {
+					if (!(sliding_attacks(slider, s1, 0) & square_bb(s2))) continue;
+					tables::between[s1.index()][s2.index()] =
+						sliding_attacks(slider, s1, square_bb(s2)) & sliding_attacks(slider, s2, square_bb(s1));
+					tables::line[s1.index()][s2.index()] = (sliding_attacks(slider, s1, 0) & sliding_attacks(slider, s2, 0)) |
+						square_bb(s1) | square_bb(s2);
+				}
+			}
+		}
+		return true;
+	}();
+}
+
 chess::Square::operator string () const
 {
 	constexpr array<char, 8> files {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h'};
@@ -89,6 +201,177 @@ bool chess::operator==(const MoveRecord& mr1, const MoveRecord& mr2)
 		mr1.promo_type() == mr2.promo_type());
 }
 
+namespace {
+	//byte j of a HalfByteBoard holds the counts of squares 2j (front nibble) and 2j + 1 (back nibble)
+#ifdef __AVX2__
+	//per byte: front where square 2j is in the set, back where square 2j + 1 is
+	__m256i nibble_mask(Bitboard squares, uint8_t front, uint8_t back)
+	{
+		const __m256i bits = _mm256_set1_epi64x(static_cast<long long>(squares));
+		const __m256i bytes = _mm256_shuffle_epi8(bits, _mm256_setr_epi8(
+			0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7));
+		const __m256i even_bit = _mm256_set1_epi32(0x40100401);
+		const __m256i odd_bit = _mm256_set1_epi32(static_cast<int>(0x80200802));
+		const __m256i even = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, even_bit), even_bit);
+		const __m256i odd = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, odd_bit), odd_bit);
+		return _mm256_or_si256(_mm256_and_si256(even, _mm256_set1_epi8(static_cast<char>(front))),
+			_mm256_and_si256(odd, _mm256_set1_epi8(static_cast<char>(back))));
+	}
+
+	int nibble_sum(__m256i v)
+	{
+		const __m256i low = _mm256_set1_epi8(0x0F);
+		const __m256i pairs = _mm256_add_epi8(_mm256_and_si256(v, low), _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+		const __m256i sums = _mm256_sad_epu8(pairs, _mm256_setzero_si256());
+		return _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+			_mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+	}
+#endif
+
+	//one bit in every nibble, for the 16 squares stored in word w (as 0x10 front, 0x01 back)
+	[[maybe_unused]] uint64_t nibble_ones(Bitboard squares, int w)
+	{
+		uint64_t x = (squares >> (16 * w)) & 0xFFFF;
+		x = ((x & 0x5555) << 1) | ((x >> 1) & 0x5555); //even squares go in the front nibble
+#ifdef __BMI2__
+		return _pdep_u64(x, 0x1111111111111111ULL);
+#else
+		x = (x | (x << 24)) & 0x000000FF000000FFULL;
+		x = (x | (x << 12)) & 0x000F000F000F000FULL;
+		x = (x | (x << 6)) & 0x0303030303030303ULL;
+		return (x | (x << 3)) & 0x1111111111111111ULL;
+#endif
+	}
+
+	//inverse of nibble_ones, taking the lowest bit of every nibble
+	[[maybe_unused]] Bitboard nibble_squares(uint64_t x, int w)
+	{
+#ifdef __BMI2__
+		x = _pext_u64(x, 0x1111111111111111ULL);
+#else
+		x &= 0x1111111111111111ULL;
+		x = (x | (x >> 3)) & 0x0303030303030303ULL;
+		x = (x | (x >> 6)) & 0x000F000F000F000FULL;
+		x = (x | (x >> 12)) & 0x000000FF000000FFULL;
+		x = (x | (x >> 24)) & 0xFFFF;
+#endif
+		x = ((x & 0x5555) << 1) | ((x >> 1) & 0x5555);
+		return x << (16 * w);
+	}
+
+	//interleave two sets of 32 flags, a in the even bits
+	[[maybe_unused]] Bitboard interleave(uint32_t a, uint32_t b)
+	{
+#ifdef __BMI2__
+		return _pdep_u64(a, 0x5555555555555555ULL) | _pdep_u64(b, 0xAAAAAAAAAAAAAAAAULL);
+#else
+		const auto spread = [](uint64_t x) {
+			x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+			x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+			x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+			x = (x | (x << 2)) & 0x3333333333333333ULL;
+			return (x | (x << 1)) & 0x5555555555555555ULL;
+		};
+		return spread(a) | (spread(b) << 1);
+#endif
+	}
+
+	[[maybe_unused]] uint64_t load_word(const array<uint8_t, 32>& data, int w) {uint64_t out; memcpy(&out, data.data() + 8 * w, 8); return out;}
+	[[maybe_unused]] void store_word(array<uint8_t, 32>& data, int w, uint64_t word) {memcpy(data.data() + 8 * w, &word, 8);}
+
+	//sum of the 16 nibbles in a word
+	[[maybe_unused]] int word_sum(uint64_t x)
+	{
+		x = (x & 0x0F0F0F0F0F0F0F0FULL) + ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+		return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+	}
+}
+
+//counts never leave 0..15, so bytewise (or even wordwise) arithmetic never carries between nibbles
+void chess::HalfByteBoard::add(Bitboard squares)
+{
+#ifdef __AVX2__
+	__m256i* const v = reinterpret_cast<__m256i*>(data.data());
+	_mm256_store_si256(v, _mm256_add_epi8(_mm256_load_si256(v), nibble_mask(squares, 0x10, 0x01)));
+#else
+	for (int w = 0; w < 4; w++) if (squares >> (16 * w) & 0xFFFF) store_word(data, w, load_word(data, w) + nibble_ones(squares, w));
+#endif
+}
+
+void chess::HalfByteBoard::sub(Bitboard squares)
+{
+#ifdef __AVX2__
+	__m256i* const v = reinterpret_cast<__m256i*>(data.data());
+	_mm256_store_si256(v, _mm256_sub_epi8(_mm256_load_si256(v), nibble_mask(squares, 0x10, 0x01)));
+#else
+	for (int w = 0; w < 4; w++) if (squares >> (16 * w) & 0xFFFF) store_word(data, w, load_word(data, w) - nibble_ones(squares, w));
+#endif
+}
+
+int chess::HalfByteBoard::sum() const
+{
+#if defined(__AVX2__)
+	return nibble_sum(_mm256_load_si256(reinterpret_cast<const __m256i*>(data.data())));
+#elif defined(__SSE2__)
+	const __m128i low = _mm_set1_epi8(0x0F);
+	__m128i total = _mm_setzero_si128();
+	for (int half = 0; half < 2; half++) {
+		const __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(data.data()) + half);
+		const __m128i pairs = _mm_add_epi8(_mm_and_si128(v, low), _mm_and_si128(_mm_srli_epi16(v, 4), low));
+		total = _mm_add_epi64(total, _mm_sad_epu8(pairs, _mm_setzero_si128()));
+	}
+	return _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(total, total));
+#else
+	int out = 0;
+	for (int w = 0; w < 4; w++) out += word_sum(load_word(data, w));
+	return out;
+#endif
+}
+
+int chess::HalfByteBoard::sum(Bitboard squares) const
+{
+#ifdef __AVX2__
+	const __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(data.data()));
+	return nibble_sum(_mm256_and_si256(v, nibble_mask(squares, 0xF0, 0x0F)));
+#else
+	int out = 0;
+	for (int w = 0; w < 4; w++) if (squares >> (16 * w) & 0xFFFF) out += word_sum(load_word(data, w) & (nibble_ones(squares, w) * 0x0F));
+	return out;
+#endif
+}
+
+Bitboard chess::HalfByteBoard::nonzero() const
+{
+#if defined(__AVX2__)
+	const __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(data.data()));
+	const __m256i low = _mm256_set1_epi8(0x0F);
+	const __m256i zero = _mm256_setzero_si256();
+	const auto front = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(_mm256_srli_epi16(v, 4), low), zero)));
+	const auto back = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, low), zero)));
+	return ~interleave(front, back);
+#elif defined(__SSE2__)
+	const __m128i low = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t front = 0;
+	uint32_t back = 0;
+	for (int half = 0; half < 2; half++) {
+		const __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(data.data()) + half);
+		front |= static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), low), zero))) << (16 * half);
+		back |= static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, low), zero))) << (16 * half);
+	}
+	return ~interleave(front, back);
+#else
+	Bitboard out = 0;
+	for (int w = 0; w < 4; w++) {
+		uint64_t x = load_word(data, w);
+		x |= x >> 1;
+		x |= x >> 2;
+		out |= nibble_squares(x, w);
+	}
+	return out;
+#endif
+}
+
 bool chess::Move::is_en_passant() const
 {
 	if (moved().type() != Piece::Type::Pawn) return false;
@@ -144,134 +427,227 @@ std::ostream& chess::operator<<(std::ostream& os, const Move& mv)
 	return nullopt;
 }*/
 
-chess::Position::Position(const string& fen)
-{
-	istringstream iss(fen);
-	vector<string> words;
-	for (string word; iss >> word;) words.push_back(word);
-
-	constexpr array<char, 7> white {'_', 'P', 'N', 'B', 'R', 'Q', 'K'};
-	constexpr array<char, 7> black {'_', 'p', 'n', 'b', 'r', 'q', 'k'};
-	
-	stringstream pieces(words[0]);
-	int num_empty = 0;
-	for (int r = 7; r >= 0; --r) {
-		for (int f = 0; f < 8; ++f) {
-			num_empty -= 1;
-			if (num_empty > 0) continue;
-			
-			char next_char;
-			pieces >> next_char;
-			int loc_w = distance(begin(white), find(begin(white), end(white), next_char));
-			if (loc_w < 7) { set(f + r * 8, Piece(Almnt::White, (Piece::Type) loc_w)); continue; }
-			int loc_b = distance(begin(black), find(begin(black), end(black), next_char));
-			if (loc_b < 7) { set(f + r * 8, Piece(Almnt::Black, (Piece::Type) loc_b)); continue; }
-			stringstream(string(1, next_char)) >> num_empty; //read int
+chess::Position::Position(string_view fen)
+{
+	FenError error;
+	const optional<Position> parsed = from_fen(fen, &error);
+	if (!parsed) throw std::invalid_argument(string("Invalid FEN at offset ") + to_string(error.offset) + ": " + error.reason);
+	*this = *parsed;
+}
+
+optional<Position> chess::Position::from_fen(string_view fen, FenError* error)
+{
+	constexpr string_view pieces = "PNBRQKpnbrqk";
+	size_t i = 0;
+	const auto fail = [&](const char* reason) -> optional<Position> {
+		if (error) *error = FenError{i, reason};
+		return nullopt;
+	};
+	const auto at_end = [&]() {return i >= fen.size() || fen[i] == ' ';};
+	const auto next_field = [&]() {
+		const bool separated = i < fen.size() && fen[i] == ' ';
+		while (i < fen.size() && fen[i] == ' ') i++;
+		return separated && i < fen.size();
+	};
+	//clocks are limited to what fits in a short
+	const auto read_number = [&](short& out) {
+		int value = 0;
+		const size_t first = i;
+		for (; !at_end(); i++) {
+			if (fen[i] < '0' || fen[i] > '9') return false;
+			value = value * 10 + (fen[i] - '0');
+			if (value > 32767) return false;
 		}
-		if (r > 0) {
-			char discard;
-			pieces >> discard;
+		out = static_cast<short>(value);
+		return i > first;
+	};
+
+	Position out;
+	while (i < fen.size() && fen[i] == ' ') i++;
+
+	int rank = 7;
+	int file = 0;
+	for (; !at_end(); i++) {
+		const char c = fen[i];
+		if (c == '/') {
+			if (file != 8 || rank == 0) return fail("rank does not have 8 files");
+			rank--;
+			file = 0;
+		}
+		else if (c >= '1' && c <= '8') {
+			file += c - '0';
+			if (file > 8) return fail("rank does not have 8 files");
+		}
+		else {
+			const size_t type = pieces.find(c);
+			if (type == string_view::npos) return fail("unexpected character in piece placement");
+			if (file > 7) return fail("rank does not have 8 files");
+			out.set(rank * 8 + file, Piece(type < 6 ? Almnt::White : Almnt::Black, static_cast<Piece::Type>(type % 6 + 1)));
+			file++;
 		}
 	}
-	
-	m_to_move = (words[1] == "w" ? Almnt::White : Almnt::Black);
-	
-	for (const char& c : words[2]) {
-		if (c == 'K') mut_castle(Almnt::White, Side::Kingside) = true;
-		if (c == 'Q') mut_castle(Almnt::White, Side::Queenside) = true;
-		if (c == 'k') mut_castle(Almnt::Black, Side::Kingside) = true;
-		if (c == 'q') mut_castle(Almnt::Black, Side::Queenside) = true;
+	if (rank != 0 || file != 8) return fail("piece placement does not have 8 ranks");
+
+	if (!next_field()) return fail("missing side to move");
+	if (fen[i] == 'w') out.m_to_move = Almnt::White;
+	else if (fen[i] == 'b') out.m_to_move = Almnt::Black;
+	else return fail("side to move is not w or b");
+	i++;
+	if (!at_end()) return fail("side to move is not w or b");
+
+	if (!next_field()) return fail("missing castling rights");
+	if (fen[i] == '-') i++;
+	else {
+		for (; !at_end(); i++) {
+			switch (fen[i]) {
+				case 'K': out.mut_castle(Almnt::White, Side::Kingside) = true; break;
+				case 'Q': out.mut_castle(Almnt::White, Side::Queenside) = true; break;
+				case 'k': out.mut_castle(Almnt::Black, Side::Kingside) = true; break;
+				case 'q': out.mut_castle(Almnt::Black, Side::Queenside) = true; break;
+				default: return fail("unexpected character in castling rights");
+			}
+		}
 	}
-	
-	m_en_passant_target = (words[3] == "-" ? nullopt : make_optional<Square>(words[3].c_str()));
-	
-	stringstream(words[4]) >> m_hm_clock;
-	stringstream(words[5]) >> m_fm_count;
-}
+	if (!at_end()) return fail("unexpected character in castling rights");
 
-void apply_castling(Position& pos, const Move& mv) {
-	const Almnt to_move = mv.moved().almnt();
-	const Square king_sq = (to_move == Almnt::White ? Square("e1") : Square("e8"));
-	const bool kingside = mv.final_sq().file() > mv.initial_sq().file();
-	const int king_dir = (kingside ? 1 : -1);
-	const Square rook_sq = (kingside ? king_sq.translate(3, 0).value() : king_sq.translate(-4, 0).value());
-	pos.set(king_sq, Piece());
-	pos.set(rook_sq, Piece());
-	pos.set(king_sq.translate(2 * king_dir, 0).value(), Piece(to_move, Piece::Type::King));
-	pos.set(king_sq.translate(king_dir, 0).value(), Piece(to_move, Piece::Type::Rook));
+	if (!next_field()) return fail("missing en passant target");
+	if (fen[i] == '-') i++;
+	else {
+		if (i + 1 >= fen.size() || fen[i] < 'a' || fen[i] > 'h' || (fen[i + 1] != '3' && fen[i + 1] != '6'))
+			return fail("en passant target is not a square on the third or sixth rank");
+		out.m_en_passant_target = all_squares[(fen[i + 1] - '1') * 8 + (fen[i] - 'a')];
+		i += 2;
+	}
+	if (!at_end()) return fail("en passant target is not a square on the third or sixth rank");
+
+	if (next_field()) {
+		if (!read_number(out.m_hm_clock)) return fail("halfmove clock is not a number");
+		if (!next_field()) return fail("missing fullmove number");
+		if (!read_number(out.m_fm_count)) return fail("fullmove number is not a number");
+		while (i < fen.size() && fen[i] == ' ') i++;
+		if (i < fen.size()) return fail("unexpected text after FEN");
+	}
+	return out;
 }
 
-void apply_en_passant(Position& pos, const Move& mv) {
-	pos.set(mv.final_sq(), pos.at(mv.initial_sq()));
-	pos.set(mv.initial_sq(), Piece());
-	const int capt_dir = (mv.final_sq().file() > mv.initial_sq().file() ? 1 : -1);
-	pos.set(mv.initial_sq().translate(capt_dir, 0).value(), Piece());
-}
+namespace {
+	//rook corner and destination squares for a castling move of the king
+	pair<Square, Square> castling_rook(MoveRecord mr)
+	{
+		const bool kingside = mr.final().file() > mr.initial().file();
+		const int corner = mr.initial().index() + (kingside ? 3 : -4);
+		const int passed = mr.initial().index() + (kingside ? 1 : -1);
+		return make_pair(all_squares[corner], all_squares[passed]);
+	}
 
-void apply_promotion(Position& pos, const Move& mv) {
-	assert(mv.promo_type());
-	pos.set(mv.final_sq(), Piece(mv.moved().almnt(), mv.promo_type().value()));
-	pos.set(mv.initial_sq(), Piece());
+	//square of the pawn taken by an en passant capture
+	Square en_passant_victim(MoveRecord mr) {return all_squares[mr.final().file() + 8 * mr.initial().rank()];}
 }
 
 chess::Position::Position(const Position& t_pos, const Move& mv)
-	: m_board(t_pos.m_board), m_to_move(!mv.moved().almnt()), m_castle(t_pos.m_castle),
-	m_hm_clock(t_pos.m_hm_clock + 1), m_fm_count(t_pos.m_fm_count)
+	: Position(t_pos)
 {
 	//Expects(t_pos.game_result() == nullopt);
 	Expects(t_pos.to_move() == mv.moved().almnt());
 	Expects(t_pos.at(mv.initial_sq()) == mv.moved());
 	if (!mv.is_en_passant()) Expects(t_pos.at(mv.final_sq()) == mv.captured());
+	make_move(mv.record());
+}
 
-	//handle move clocks
-	if(to_move() == Almnt::White) m_fm_count += 1;
-	if(mv.captured().type() != Piece::Type::Empty) m_hm_clock = 0;
-	if(mv.moved().type() == Piece::Type::Pawn) m_hm_clock = 0;
+Position::Undo chess::Position::make_move(MoveRecord mr)
+{
+	const Square start = mr.initial();
+	const Square end = mr.final();
+	const Piece moved = at(start);
+	const Almnt us = moved.almnt();
+	const int file_delta = static_cast<int>(end.file()) - static_cast<int>(start.file());
+	const bool castling = moved.type() == Piece::Type::King && abs(file_delta) > 1;
+	const bool en_passant = moved.type() == Piece::Type::Pawn && file_delta != 0 && at(end).type() == Piece::Type::Empty;
+	const Piece captured = (en_passant ? Piece(!us, Piece::Type::Pawn) : at(end));
+	Expects(moved.type() != Piece::Type::Empty);
+	Expects(captured.almnt_res() != us);
+
+	const Undo undo {mr, captured, m_castle, m_en_passant_target, m_hm_clock, m_fm_count};
 
-	if (mv.is_castling()) {
-		apply_castling(*this, mv);
-	}
-	else if (mv.is_promotion()) {
-		apply_promotion(*this, mv);
-	}
-	else if (mv.is_en_passant()) {
-		apply_en_passant(*this, mv);
-	}
-	else {
-		this->set(mv.final_sq(), this->at(mv.initial_sq()));
-		this->set(mv.initial_sq(), Piece());
+	//handle move clocks
+	m_hm_clock += 1;
+	if (us == Almnt::Black) m_fm_count += 1;
+	if (captured.type() != Piece::Type::Empty) m_hm_clock = 0;
+	if (moved.type() == Piece::Type::Pawn) m_hm_clock = 0;
+
+	set(start, Piece());
+	set(end, mr.is_promo() ? Piece(us, mr.promo_type().value()) : moved);
+	if (castling) {
+		const auto rook = castling_rook(mr);
+		set(rook.first, Piece());
+		set(rook.second, Piece(us, Piece::Type::Rook));
 	}
+	if (en_passant) set(en_passant_victim(mr), Piece());
 
 	//check to disable castling
-	if (mv.moved().type() == Piece::Type::King && 
-		(can_castle(t_pos.to_move(), Side::Kingside) ||
-		can_castle(t_pos.to_move(), Side::Queenside))) {
-		mut_castle(t_pos.to_move(), Side::Kingside) = false;
-		mut_castle(t_pos.to_move(), Side::Queenside) = false;
+	if (moved.type() == Piece::Type::King) {
+		mut_castle(us, Side::Kingside) = false;
+		mut_castle(us, Side::Queenside) = false;
 	}
-	if (mv.moved().type() == Piece::Type::Rook) {
-		if (can_castle(t_pos.to_move(), Side::Queenside) && mv.initial_sq().file() == 0) {
-			mut_castle(t_pos.to_move(), Side::Queenside) = false;
-		}
-		if (can_castle(t_pos.to_move(), Side::Kingside) && mv.initial_sq().file() == 7) {
-			mut_castle(t_pos.to_move(), Side::Kingside) = false;
-		}
+	const auto home_rank = [](Almnt a) {return (a == Almnt::White ? 0 : 7);};
+	if (moved.type() == Piece::Type::Rook && start.rank() == home_rank(us)) {
+		if (start.file() == 0) mut_castle(us, Side::Queenside) = false;
+		if (start.file() == 7) mut_castle(us, Side::Kingside) = false;
 	}
-	if (mv.captured().type() == Piece::Type::Rook) {
-		if (can_castle(!t_pos.to_move(), Side::Queenside) && mv.final_sq().file() == 0) {
-			mut_castle(!t_pos.to_move(), Side::Queenside) = false;
-		}
-		if (can_castle(!t_pos.to_move(), Side::Kingside) && mv.final_sq().file() == 7) {
-			mut_castle(!t_pos.to_move(), Side::Kingside) = false;
-		}
+	if (captured.type() == Piece::Type::Rook && end.rank() == home_rank(!us)) {
+		if (end.file() == 0) mut_castle(!us, Side::Queenside) = false;
+		if (end.file() == 7) mut_castle(!us, Side::Kingside) = false;
 	}
 
 	//create en_passant_target
-	if (mv.moved().type() == Piece::Type::Pawn) {
-		const int rank_gap = mv.final_sq().rank() - mv.initial_sq().rank();
-		if (rank_gap == 2) m_en_passant_target = mv.initial_sq().translate(0,1);
-		if (rank_gap == -2) m_en_passant_target = mv.initial_sq().translate(0,-1);
+	m_en_passant_target = nullopt;
+	if (moved.type() == Piece::Type::Pawn) {
+		const int rank_gap = end.rank() - start.rank();
+		if (rank_gap == 2) m_en_passant_target = start.translate(0,1);
+		if (rank_gap == -2) m_en_passant_target = start.translate(0,-1);
+	}
+
+	m_to_move = !us;
+	return undo;
+}
+
+void chess::Position::unmake_move(const Undo& undo)
+{
+	const MoveRecord mr = undo.record;
+	const Square start = mr.initial();
+	const Square end = mr.final();
+	const Almnt us = !m_to_move;
+	const Piece moved = (mr.is_promo() ? Piece(us, Piece::Type::Pawn) : at(end));
+	Expects(at(end).almnt_res() == us);
+
+	const int file_delta = static_cast<int>(end.file()) - static_cast<int>(start.file());
+	const bool castling = moved.type() == Piece::Type::King && abs(file_delta) > 1;
+	const bool en_passant = moved.type() == Piece::Type::Pawn && undo.en_passant_target && end == *undo.en_passant_target;
+
+	set(start, moved);
+	set(end, en_passant ? Piece() : undo.captured);
+	if (en_passant) set(en_passant_victim(mr), undo.captured);
+	if (castling) {
+		const auto rook = castling_rook(mr);
+		set(rook.second, Piece());
+		set(rook.first, Piece(us, Piece::Type::Rook));
 	}
+
+	m_to_move = us;
+	m_castle = undo.castle;
+	m_en_passant_target = undo.en_passant_target;
+	m_hm_clock = undo.hm_clock;
+	m_fm_count = undo.fm_count;
+}
+
+Bitboard chess::Position::attackers(Square s, Bitboard occupied) const
+{
+	return (pawn_attacks(Almnt::White, s) & pieces(Almnt::Black, Piece::Type::Pawn)) |
+		(pawn_attacks(Almnt::Black, s) & pieces(Almnt::White, Piece::Type::Pawn)) |
+		(knight_attacks(s) & pieces(Piece::Type::Knight)) |
+		(king_attacks(s) & pieces(Piece::Type::King)) |
+		(rook_attacks(s, occupied) & (pieces(Piece::Type::Rook) | pieces(Piece::Type::Queen))) |
+		(bishop_attacks(s, occupied) & (pieces(Piece::Type::Bishop) | pieces(Piece::Type::Queen)));
 }
 
 Position chess::Position::std_start()
@@ -290,12 +666,21 @@ Position chess::Position::std_start()
 	return pos;
 }
 
-string chess::Position::as_fen() const
+string_view chess::Position::write_fen(FenBuffer& buffer) const
 {
 	constexpr array<char, 7> white {' ', 'P', 'N', 'B', 'R', 'Q', 'K'};
 	constexpr array<char, 7> black {'@', 'p', 'n', 'b', 'r', 'q', 'k'};
-	
-	string output = "";
+	char* out = buffer.data();
+	const auto write_number = [&](int value) {
+		array<char, 5> digits;
+		int count = 0;
+		do {
+			digits[count++] = static_cast<char>('0' + value % 10);
+			value /= 10;
+		} while (value > 0);
+		while (count > 0) *out++ = digits[--count];
+	};
+
 	for (int r = 7; r >= 0; r--) {
 		int empty_counter = 0;
 		for (int f = 0; f < 8; f++) {
@@ -305,46 +690,53 @@ string chess::Position::as_fen() const
 				continue;
 			}
 			if (empty_counter != 0) {
-				output += to_string(empty_counter);
+				*out++ = static_cast<char>('0' + empty_counter);
 				empty_counter = 0;
 			}
-			output += (p.almnt() == Almnt::White ? white[(int) p.type()] : black[(int) p.type()]);
+			*out++ = (p.almnt() == Almnt::White ? white[(int) p.type()] : black[(int) p.type()]);
 		}
-		if (empty_counter != 0) {
-			output += to_string(empty_counter);
-			empty_counter = 0;
-		}
-		if (r != 0) output += '/';
+		if (empty_counter != 0) *out++ = static_cast<char>('0' + empty_counter);
+		if (r != 0) *out++ = '/';
 	}
 
-	output += (to_move() == Almnt::White ? " w" : " b");
+	*out++ = ' ';
+	*out++ = (to_move() == Almnt::White ? 'w' : 'b');
+
+	*out++ = ' ';
+	const char* const castling = out;
+	if (can_castle(Almnt::White, Side::Kingside)) *out++ = 'K';
+	if (can_castle(Almnt::White, Side::Queenside)) *out++ = 'Q';
+	if (can_castle(Almnt::Black, Side::Kingside)) *out++ = 'k';
+	if (can_castle(Almnt::Black, Side::Queenside)) *out++ = 'q';
+	if (out == castling) *out++ = '-';
+
+	*out++ = ' ';
+	if (en_passant_target()) {
+		*out++ = static_cast<char>('a' + en_passant_target()->file());
+		*out++ = static_cast<char>('1' + en_passant_target()->rank());
+	}
+	else *out++ = '-';
 
-	output += ' ';
-	bool no_castling = true;
-	if (can_castle(Almnt::White, Side::Kingside)) {output += 'K'; no_castling = false;}
-	if (can_castle(Almnt::White, Side::Queenside)) {output += 'Q'; no_castling = false;}
-	if (can_castle(Almnt::Black, Side::Kingside)) {output += 'k'; no_castling = false;}
-	if (can_castle(Almnt::Black, Side::Queenside)) {output += 'q'; no_castling = false;}
-	if (no_castling) output += '-';
+	*out++ = ' ';
+	write_number(hm_clock());
+	*out++ = ' ';
+	write_number(fm_count());
 
-	output += ' ';
-	if(en_passant_target()) output += (string) en_passant_target().value();
-	else output += '-';
+	assert(out <= buffer.data() + buffer.size());
+	return string_view(buffer.data(), out - buffer.data());
+}
 
-	output += ' ';
-	output += to_string(hm_clock());
-	output += ' ';
-	output += to_string(fm_count());
-	
-	return output;
+string chess::Position::as_fen() const
+{
+	FenBuffer buffer;
+	return string(write_fen(buffer));
 }
 
 bool chess::operator==(const Position& p1, const Position& p2)
 {
-	return (p1.m_board == p2.m_board &&
-		p1.m_to_move == p2.m_to_move &&
-		p1.m_en_passant_target == p2.m_en_passant_target &&
-		p1.m_castle == p2.m_castle);
+	//a 64 bit key makes collisions between positions reached in one game vanishingly unlikely
+	assert(p1.hash() != p2.hash() || (p1.m_board == p2.m_board && p1.m_en_passant_target == p2.m_en_passant_target));
+	return p1.hash() == p2.hash();
 }
 
 bool chess::operator!=(const Position& p1, const Position& p2)
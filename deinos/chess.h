@@ -4,10 +4,18 @@
 #include <array>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cassert>
 #include <iostream>
 #include <gsl/gsl_assert>
+#include <gsl/gsl_util>
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#if defined(__BMI2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace chess {
 	enum class Almnt : uint8_t;
@@ -92,6 +100,7 @@ namespace chess {
 		std::optional<Square> translate(int files, int ranks) const; //TODO consider changing type to int8_t
 		inline uint8_t file() const {return std::to_integer<uint8_t>(data & std::byte{0b00000111});}
 		inline uint8_t rank() const {return std::to_integer<uint8_t>((data & std::byte{0b00111000}) >> 3);}
+		inline uint8_t index() const {return std::to_integer<uint8_t>(data);} //rank * 8 + file, as in all_squares
 		explicit operator std::string () const;
 	private:
 		constexpr Square(uint8_t file, uint8_t rank) : data((std::byte{rank} << 3) | std::byte{file}) {
@@ -117,6 +126,125 @@ namespace chess {
 		"a8", "b8", "c8", "d8", "e8", "f8", "g8", "h8",
 		};
 
+	//A set of squares, bit n representing all_squares[n]
+	typedef uint64_t Bitboard;
+	constexpr Bitboard square_bb(int index) {return Bitboard{1} << index;}
+	inline Bitboard square_bb(Square s) {return square_bb(s.index());}
+	inline int popcount(Bitboard bb) {return __builtin_popcountll(bb);}
+	inline int lsb(Bitboard bb) {assert(bb != 0); return __builtin_ctzll(bb);}
+	inline int pop_lsb(Bitboard& bb) {const int index = lsb(bb); bb &= bb - 1; return index;}
+	constexpr Bitboard file_bb(int file) {return Bitboard{0x0101010101010101} << file;}
+	constexpr Bitboard rank_bb(int rank) {return Bitboard{0xFF} << (8 * rank);}
+
+	//Sliding attacks are looked up through fancy magic bitboards, or PEXT where BMI2 is available
+	struct Magic {
+		Bitboard mask = 0; //relevant occupancy, excluding board edges
+		Bitboard magic = 0;
+		const Bitboard* attacks = nullptr;
+		unsigned shift = 0;
+		inline unsigned index(Bitboard occupied) const
+		{
+#ifdef __BMI2__
+			return static_cast<unsigned>(_pext_u64(occupied, mask));
+#else
+			return static_cast<unsigned>(((occupied & mask) * magic) >> shift);
+#endif
+		}
+	};
+
+	//Squares reached by walking from a square in one direction, nearest first
+	struct Ray {
+		std::array<Square, 7> squares = {};
+		uint8_t length = 0;
+		constexpr const Square* begin() const {return squares.data();}
+		constexpr const Square* end() const {return squares.data() + length;}
+	};
+
+	//Compile time construction of the non-sliding tables
+	namespace detail {
+		struct Offset {int files; int ranks;};
+		constexpr bool on_board(int file, int rank) {return file >= 0 && file < 8 && rank >= 0 && rank < 8;}
+		
+		template <std::size_t N>
+		constexpr std::array<Bitboard, 64> jump_table(const std::array<Offset, N>& offsets)
+		{
+			std::array<Bitboard, 64> out = {};
+			for (int i = 0; i < 64; i++) {
+				for (const Offset& o : offsets) {
+					const int file = i % 8 + o.files;
+					const int rank = i / 8 + o.ranks;
+					if (on_board(file, rank)) out[i] |= square_bb(rank * 8 + file);
+				}
+			}
+			return out;
+		}
+		
+		constexpr std::array<std::array<Bitboard, 64>, 2> pawn_push_table()
+		{
+			std::array<std::array<Bitboard, 64>, 2> out = {};
+			for (int i = 8; i < 56; i++) {
+				out[0][i] = square_bb(i + 8) | (i / 8 == 1 ? square_bb(i + 16) : 0);
+				out[1][i] = square_bb(i - 8) | (i / 8 == 6 ? square_bb(i - 16) : 0);
+			}
+			return out;
+		}
+		
+		//clockwise from north, so odd directions are diagonal
+		constexpr std::array<Offset, 8> directions {{{0, 1}, {1, 1}, {1, 0}, {1, -1}, {0, -1}, {-1, -1}, {-1, 0}, {-1, 1}}};
+		
+		constexpr std::array<std::array<Ray, 64>, 8> ray_table()
+		{
+			std::array<std::array<Ray, 64>, 8> out = {};
+			for (int dir = 0; dir < 8; dir++) {
+				for (int i = 0; i < 64; i++) {
+					Ray& ray = out[dir][i];
+					int file = i % 8 + directions[dir].files;
+					int rank = i / 8 + directions[dir].ranks;
+					for (; on_board(file, rank); file += directions[dir].files, rank += directions[dir].ranks)
+						ray.squares[ray.length++] = all_squares[rank * 8 + file];
+				}
+			}
+			return out;
+		}
+	}
+
+	namespace tables {
+		inline constexpr std::array<Bitboard, 64> knight = detail::jump_table<8>(
+			{{{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}}});
+		inline constexpr std::array<Bitboard, 64> king = detail::jump_table<8>(
+			{{{0, 1}, {1, 1}, {1, 0}, {1, -1}, {0, -1}, {-1, -1}, {-1, 0}, {-1, 1}}});
+		inline constexpr std::array<std::array<Bitboard, 64>, 2> pawn { //capturing squares indexed by alignment
+			detail::jump_table<2>({{{-1, 1}, {1, 1}}}), detail::jump_table<2>({{{-1, -1}, {1, -1}}})};
+		inline constexpr std::array<std::array<Bitboard, 64>, 2> pawn_push = detail::pawn_push_table(); //on an empty board
+		inline constexpr std::array<std::array<Ray, 64>, 8> rays = detail::ray_table(); //indexed by direction, then square
+		
+		//filled in once at static initialisation
+		extern std::array<Magic, 64> rook_magics;
+		extern std::array<Magic, 64> bishop_magics;
+		extern std::array<std::array<Bitboard, 64>, 64> between; //squares strictly between two aligned squares
+		extern std::array<std::array<Bitboard, 64>, 64> line; //full board line through two aligned squares
+	}
+
+	//Squares attacked from s, stopping at (and including) the first occupied square in each direction
+	inline Bitboard rook_attacks(Square s, Bitboard occupied)
+	{
+		const Magic& m = tables::rook_magics[s.index()];
+		return m.attacks[m.index(occupied)];
+	}
+	inline Bitboard bishop_attacks(Square s, Bitboard occupied)
+	{
+		const Magic& m = tables::bishop_magics[s.index()];
+		return m.attacks[m.index(occupied)];
+	}
+	inline Bitboard queen_attacks(Square s, Bitboard occupied) {return rook_attacks(s, occupied) | bishop_attacks(s, occupied);}
+	inline Bitboard knight_attacks(Square s) {return tables::knight[s.index()];}
+	inline Bitboard king_attacks(Square s) {return tables::king[s.index()];}
+	inline Bitboard pawn_attacks(Almnt a, Square s) {return tables::pawn[static_cast<uint8_t>(a)][s.index()];}
+	inline Bitboard pawn_pushes(Almnt a, Square s) {return tables::pawn_push[static_cast<uint8_t>(a)][s.index()];}
+	inline const Ray& ray(int dir, Square s) {return tables::rays[dir][s.index()];} //dir clockwise from north
+	inline Bitboard between_bb(Square s1, Square s2) {return tables::between[s1.index()][s2.index()];} //empty if not aligned
+	inline Bitboard line_bb(Square s1, Square s2) {return tables::line[s1.index()][s2.index()];} //empty if not aligned
+
 	//stores information necessary to reconstruct a move from a position
 	struct MoveRecord {
 	private:
@@ -127,6 +255,7 @@ namespace chess {
 			{Piece::Type::Knight, Piece::Type::Bishop, Piece::Type::Rook, Piece::Type::Queen};
 		
 		static_assert(sizeof(Square) == 1);
+		constexpr MoveRecord() = default;
 		constexpr MoveRecord(Square t_initial, Square t_final)
 			: data1(reinterpret_cast<std::byte&>(t_initial)), data2(reinterpret_cast<std::byte&>(t_final)) {}
 		MoveRecord(Square t_initial, Square t_final, Piece::Type t_promo_type);
@@ -147,6 +276,60 @@ namespace chess {
 	inline bool operator!=(const MoveRecord& mr1, const MoveRecord& mr2) {return !(mr1 == mr2);}
 	inline std::ostream& operator<<(std::ostream& os, const MoveRecord& mr) {os << mr.to_string(); return os;}
 
+	//A bounded list of legal moves stored inline, for move generation without allocation
+	class MoveList {
+	public:
+		static constexpr std::size_t inline_capacity = 218; //the most legal moves of any reachable position
+		//from_fen accepts any placement. a side with n pieces has at most min(27n, n(64 - n)) <= 999 moves to
+		//distinct squares, and promotions add 3 for each of at most 24 pawn moves onto the last rank. a list longer
+		//than inline_capacity moves to the heap
+		static constexpr std::size_t capacity = 999 + 3 * 24;
+		MoveList() = default;
+		MoveList(const MoveList& other) {*this = other;}
+		MoveList& operator=(const MoveList& other) //copy only the moves in use
+		{
+			if (other.m_size > inline_capacity && !m_heap) m_heap.reset(new MoveRecord[capacity]);
+			m_size = other.m_size;
+			std::copy(other.begin(), other.end(), begin());
+			return *this;
+		}
+
+		template <typename... Args>
+		inline void emplace_back(Args&&... args)
+		{
+			Expects(m_size < capacity);
+			if (m_size == inline_capacity && !m_heap) spill();
+			begin()[m_size++] = MoveRecord(std::forward<Args>(args)...);
+		}
+		inline MoveRecord* erase(MoveRecord* first, MoveRecord* last) //as std::vector::erase
+		{
+			MoveRecord* const out = std::move(last, end(), first);
+			m_size = gsl::narrow_cast<uint16_t>(out - begin());
+			return first;
+		}
+		inline void clear() {m_size = 0;}
+
+		inline MoveRecord* begin() {return (m_heap ? m_heap.get() : m_data.data());}
+		inline MoveRecord* end() {return begin() + m_size;}
+		inline const MoveRecord* begin() const {return data();}
+		inline const MoveRecord* end() const {return data() + m_size;}
+		inline const MoveRecord* data() const {return (m_heap ? m_heap.get() : m_data.data());}
+		inline std::size_t size() const {return m_size;}
+		inline bool empty() const {return m_size == 0;}
+		inline MoveRecord operator[](std::size_t i) const {assert(i < m_size); return data()[i];}
+	private:
+		void spill()
+		{
+			m_heap.reset(new MoveRecord[capacity]);
+			std::copy(m_data.begin(), m_data.begin() + m_size, m_heap.get());
+		}
+
+		std::array<MoveRecord, inline_capacity> m_data;
+		uint16_t m_size = 0;
+		std::unique_ptr<MoveRecord[]> m_heap; //holds the moves instead of m_data once they outgrow it
+	};
+	static_assert(sizeof(MoveList) <= MoveList::inline_capacity * sizeof(MoveRecord) + 2 * sizeof(void*));
+
 	//64 half-byte uints stored in 32B
 	struct HalfByteBoard {
 	private:
@@ -172,38 +355,130 @@ namespace chess {
 			else set_back(i / 2, val);
 		}
 		inline void set(int file, int rank, uint8_t val) {set(rank * 8 + file, val);}
+
+		//bulk operations, vectorised with AVX2 or SSE2 where available
+		void add(Bitboard squares); //increment every square in the set, counts must stay below 16
+		void sub(Bitboard squares); //decrement every square in the set, counts must stay above -1
+		int sum() const;
+		int sum(Bitboard squares) const; //total over the squares in the set
+		Bitboard nonzero() const; //squares with a count above zero
 	private:
-		std::array<uint8_t, 32> data = {0};
+		alignas(32) std::array<uint8_t, 32> data = {0}; //even indices in the front (high) nibble
 		friend bool operator==(const HalfByteBoard&, const HalfByteBoard&);
 	};
 	inline bool operator==(const HalfByteBoard& hbb1, const HalfByteBoard& hbb2) {return hbb1.data == hbb2.data;}
 	inline bool operator!=(const HalfByteBoard& hbb1, const HalfByteBoard& hbb2) {return !(hbb1 == hbb2);}
 
+	//Random keys for Zobrist hashing, generated at compile time with splitmix64
+	namespace zobrist {
+		struct Keys {
+			std::array<std::array<uint64_t, 64>, 16> pieces = {}; //indexed by raw piece data, empty squares hash to 0
+			std::array<uint64_t, 16> castling = {}; //indexed by a 4 bit mask of castling rights
+			std::array<uint64_t, 8> en_passant = {}; //indexed by file
+			uint64_t black_to_move = 0;
+		};
+
+		constexpr uint64_t splitmix64(uint64_t& state)
+		{
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			return z ^ (z >> 31);
+		}
+
+		constexpr Keys make_keys()
+		{
+			Keys k;
+			uint64_t state = 0x6465696E6F73ULL;
+			for (int p = 2; p < 16; p++) for (int i = 0; i < 64; i++) k.pieces[p][i] = splitmix64(state);
+			std::array<uint64_t, 4> rights = {};
+			for (auto& r : rights) r = splitmix64(state);
+			for (int mask = 0; mask < 16; mask++) {
+				for (int i = 0; i < 4; i++) if (mask & (1 << i)) k.castling[mask] ^= rights[i];
+			}
+			for (auto& e : k.en_passant) e = splitmix64(state);
+			k.black_to_move = splitmix64(state);
+			return k;
+		}
+
+		inline constexpr Keys keys = make_keys();
+	}
+
 	//Equivalent to a chess position recorded in Forsyth-Edwards Notaion
 	class Position {
 	public:
 		constexpr Position() = default;
-		Position(const std::string& fen); //construct from FEN representation
+		Position(std::string_view fen); //construct from FEN representation, throws std::invalid_argument if malformed
 		Position(const Position&, const Move&); //generate new position by applying a move
 		static Position std_start();
 
+		//state that cannot be recovered from a position and the move that reached it
+		struct Undo {
+			MoveRecord record;
+			Piece captured; //the pawn taken, for en passant
+			std::array<std::array<bool, 2>, 2> castle;
+			std::optional<Square> en_passant_target;
+			short hm_clock;
+			short fm_count;
+		};
+		Undo make_move(MoveRecord); //apply a legal move in place
+		void unmake_move(const Undo&); //restore the position before the move that returned this record
+
 		//inline Piece& operator[] (Square s) {return m_board[s.file()][s.rank()];}
 		//inline Piece operator[] (Square s) const {return m_board[s.file()][s.rank()];}
 		inline Piece at(Square s) const {return Piece(m_board.get(s.file(), s.rank()));}
 		//inline Piece at(Square s) const {return m_board[s.file()][s.rank()];}
 		inline Piece at(int index) const {return Piece(m_board.get(index));}
 		//inline Piece at(int index) const {return m_board[index % 8][index / 8];}
-		inline void set(Square s, Piece p) {m_board.set(s.file(), s.rank(), p.raw());}
+		inline void set(Square s, Piece p) {set(s.index(), p);}
 		//inline void set(Square s, Piece p) {m_board[s.file()][s.rank()] = p;}
-		inline void set(int index, Piece p) {m_board.set(index, p.raw());}
+		inline void set(int index, Piece p)
+		{
+			const Piece old = at(index);
+			const Bitboard bb = square_bb(index);
+			m_pieces[static_cast<uint8_t>(old.type())] &= ~bb;
+			m_colours[as_index(old.almnt())] &= ~bb;
+			if (p.type() != Piece::Type::Empty) {
+				m_pieces[static_cast<uint8_t>(p.type())] |= bb;
+				m_colours[as_index(p.almnt())] |= bb;
+			}
+			m_board.set(index, p.raw());
+			m_key ^= zobrist::keys.pieces[old.raw()][index] ^ zobrist::keys.pieces[p.raw()][index];
+		}
 		//inline void set(int index, Piece p) {m_board[index % 8][index / 8] = p;}
+		inline Bitboard pieces(Piece::Type t) const {return m_pieces[static_cast<uint8_t>(t)];}
+		inline Bitboard pieces(Almnt a) const {return m_colours[as_index(a)];}
+		inline Bitboard pieces(Almnt a, Piece::Type t) const {return pieces(a) & pieces(t);}
+		inline Bitboard occupied() const {return m_colours[0] | m_colours[1];}
+		Bitboard attackers(Square s, Bitboard occupied) const; //pieces of either alignment attacking s given an occupancy
 		inline bool can_castle(Almnt a, Side s) const {return m_castle[(int) a][(int) s];} //TODO use as_index
 		inline bool& mut_castle(Almnt a, Side s){return m_castle[(int) a][(int) s];}
 		inline Almnt to_move() const {return m_to_move;}
 		inline std::optional<Square> en_passant_target() const {return m_en_passant_target;}
 		inline int hm_clock() const {return m_hm_clock;}
 		inline int fm_count() const {return m_fm_count;}
+		inline uint64_t hash() const //Zobrist key of everything compared by operator==
+		{
+			uint64_t out = hash_bar_ep();
+			if (m_en_passant_target) out ^= zobrist::keys.en_passant[m_en_passant_target->file()];
+			return out;
+		}
+		inline uint64_t hash_bar_ep() const
+		{
+			const int castling = m_castle[0][0] | (m_castle[0][1] << 1) | (m_castle[1][0] << 2) | (m_castle[1][1] << 3);
+			return m_key ^ zobrist::keys.castling[castling] ^ (m_to_move == Almnt::Black ? zobrist::keys.black_to_move : 0);
+		}
+
+		//a malformed FEN, with the offset of the offending character
+		struct FenError {
+			std::size_t offset = 0;
+			const char* reason = "";
+		};
+		static std::optional<Position> from_fen(std::string_view fen, FenError* error = nullptr); //missing clocks default to "0 1"
 
+		static constexpr std::size_t max_fen_length = 93;
+		typedef std::array<char, max_fen_length> FenBuffer;
+		std::string_view write_fen(FenBuffer& buffer) const; //the returned view points into buffer
 		std::string as_fen() const;
 		explicit operator std::string() const;
 		friend std::ostream& operator<<(std::ostream& os, const Position& pos);
@@ -213,12 +488,15 @@ namespace chess {
 		static_assert(sizeof(Piece) == 1);
 		HalfByteBoard m_board;
 		//std::array<std::array<Piece, 8>, 8> m_board = {Piece()};
+		std::array<Bitboard, 7> m_pieces = {0}; //indexed by Piece::Type, the Empty entry is unused
+		std::array<Bitboard, 2> m_colours = {0};
 		Almnt m_to_move = Almnt::White;
 		std::array<std::array<bool, 2>, 2> m_castle = {{false}}; //"permitted to castle" flags indexed by enum values
 		//std::optional<GameResult> m_result = std::nullopt;
 		std::optional<Square> m_en_passant_target = std::nullopt;
 		short m_hm_clock = 0;
 		short m_fm_count = 1;
+		uint64_t m_key = 0; //Zobrist key of the board alone, updated by set()
 	};
 	bool operator==(const Position&, const Position&);
 	bool operator!=(const Position&, const Position&);
@@ -234,7 +512,7 @@ namespace chess {
 		//void set_castling(); //castling 1.must be a king moving 2.must not capture 3.can only set once
 		//void set_promotion(Piece::Type); //pawn promotion
 		//void set_en_passant(); //en_passant
-		constexpr Move(const Position& t_pos, const MoveRecord& t_record) : m_pos(t_pos), m_record(t_record) {
+		Move(const Position& t_pos, const MoveRecord& t_record) : m_pos(t_pos), m_record(t_record) {
 			if (moved().type() == Piece::Type::Empty) {std::cerr << *this << std::endl << t_pos << std::endl; throw std::exception();}
 			if (captured().almnt_res() == moved().almnt()) {std::cerr << *this << " capt: " << captured() << " mr: " << m_record << std::endl << t_pos << std::endl; throw std::exception();}
 			assert(moved().type() != Piece::Type::Empty);
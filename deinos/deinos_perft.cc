@@ -0,0 +1,181 @@
+#include "deinos/chess.h"
+#include "deinos/algorithm.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <optional>
+using namespace std;
+using namespace chess;
+using namespace algorithm;
+
+//Counts the leaves of the legal move tree to a fixed depth, checking move generation and timing it.
+//usage: deinos_perft [--incremental|--unmake|--staged] <depth> [fen]    divide output for one position
+//       deinos_perft [--incremental|--unmake|--staged] --suite [depth]  standard positions against known counts (default depth 4)
+//--incremental builds children through AnalysedPosition::advance_by, as search does, instead of the full constructor
+//--unmake walks the tree in place with make_move and unmake_move
+//--staged walks a bare Position with the moves from StagedMoves
+
+namespace {
+	enum class Mode {Rebuild, Incremental, Unmake, Staged};
+	Mode mode = Mode::Rebuild;
+
+	uint64_t perft(AnalysedPosition& ap, int depth);
+
+	uint64_t count_after(AnalysedPosition& ap, MoveRecord mr, int depth)
+	{
+		if (mode == Mode::Unmake) {
+			const auto undo = ap.make_move(mr);
+			const uint64_t count = perft(ap, depth);
+			ap.unmake_move(undo);
+			return count;
+		}
+		AnalysedPosition next = (mode == Mode::Rebuild ? AnalysedPosition(Move(ap.pos(), mr).apply()) : ap);
+		if (mode == Mode::Incremental) next.advance_by(mr);
+		return perft(next, depth);
+	}
+
+	uint64_t perft(AnalysedPosition& ap, int depth)
+	{
+		if (depth == 0) return 1;
+		if (depth == 1) return ap.moves().size(); //only legal moves are generated
+		uint64_t total = 0; //unmake_move restores the list, so it can be read between moves
+		for (int i = 0; i < ap.moves().size(); i++) total += count_after(ap, ap.moves()[i], depth - 1);
+		return total;
+	}
+
+	uint64_t staged_perft(Position& pos, int depth)
+	{
+		if (depth == 0) return 1;
+		StagedMoves moves(pos); //later stages are generated once pos has been restored
+		uint64_t total = 0;
+		while (const auto mr = moves.next()) {
+			if (depth == 1) {total++; continue;}
+			const auto undo = pos.make_move(*mr);
+			total += staged_perft(pos, depth - 1);
+			pos.unmake_move(undo);
+		}
+		return total;
+	}
+
+	vector<MoveRecord> root_moves(const Position& pos)
+	{
+		if (mode != Mode::Staged) {
+			const AnalysedPosition root(pos);
+			return vector<MoveRecord>(root.moves().begin(), root.moves().end());
+		}
+		vector<MoveRecord> out;
+		StagedMoves moves(pos);
+		while (const auto mr = moves.next()) out.push_back(*mr);
+		return out;
+	}
+
+	uint64_t count_from(const Position& pos, int depth)
+	{
+		if (mode == Mode::Staged) {
+			Position root = pos;
+			return staged_perft(root, depth);
+		}
+		AnalysedPosition root(pos);
+		return perft(root, depth);
+	}
+
+	struct SuiteEntry {
+		const char* fen;
+		vector<uint64_t> counts; //by depth, starting at 1
+	};
+
+	const vector<SuiteEntry> suite {
+		{"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", {20, 400, 8902, 197281, 4865609, 119060324}},
+		{"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", {48, 2039, 97862, 4085603, 193690690}},
+		{"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", {14, 191, 2812, 43238, 674624, 11030083}},
+		{"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", {6, 264, 9467, 422333, 15833292}},
+		{"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", {44, 1486, 62379, 2103487, 89941194}},
+		{"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", {46, 2079, 89890, 3894594, 164075551}},
+	};
+
+	void report(uint64_t nodes, chrono::steady_clock::duration elapsed)
+	{
+		const double seconds = chrono::duration<double>(elapsed).count();
+		cout << "Nodes: " << nodes << "  Time: " << static_cast<int>(seconds * 1000) << "ms";
+		cout << "  NPS: " << static_cast<uint64_t>(nodes / max(seconds, 1e-9)) << endl;
+	}
+
+	int divide(const Position& root, int depth)
+	{
+		const auto start = chrono::steady_clock::now();
+		if (depth == 0) { //no moves to divide by; the root is the only leaf
+			report(1, chrono::steady_clock::now() - start);
+			return 0;
+		}
+		uint64_t total = 0;
+		for (const MoveRecord mr : root_moves(root)) {
+			const uint64_t count = count_from(Move(root, mr).apply(), depth - 1);
+			cout << mr << ": " << count << endl;
+			total += count;
+		}
+		report(total, chrono::steady_clock::now() - start);
+		return 0;
+	}
+
+	int run_suite(int depth)
+	{
+		int failures = 0;
+		uint64_t total = 0;
+		const auto start = chrono::steady_clock::now();
+		for (const auto& entry : suite) {
+			const Position root(entry.fen);
+			for (int d = 1; d <= depth && d <= (int) entry.counts.size(); d++) {
+				const uint64_t count = count_from(root, d);
+				total += count;
+				const bool ok = count == entry.counts[d - 1];
+				if (!ok) failures++;
+				cout << (ok ? "ok   " : "FAIL ") << entry.fen << " depth " << d << ": " << count;
+				if (!ok) cout << " (expected " << entry.counts[d - 1] << ")";
+				cout << endl;
+			}
+		}
+		report(total, chrono::steady_clock::now() - start);
+		return failures == 0 ? 0 : 1;
+	}
+
+	optional<int> parse_depth(const string& arg)
+	{
+		if (arg.empty() || arg.size() > 3) return nullopt;
+		if (!all_of(arg.begin(), arg.end(), [](char c){return c >= '0' && c <= '9';})) return nullopt;
+		return stoi(arg);
+	}
+
+	int usage()
+	{
+		cerr << "usage: deinos_perft [--incremental|--unmake|--staged] <depth> [fen]" << endl;
+		cerr << "       deinos_perft [--incremental|--unmake|--staged] --suite [depth]" << endl;
+		return 2;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	vector<string> args(argv + 1, argv + argc);
+	if (!args.empty() && (args[0] == "--incremental" || args[0] == "--unmake" || args[0] == "--staged")) {
+		mode = (args[0] == "--unmake" ? Mode::Unmake : args[0] == "--staged" ? Mode::Staged : Mode::Incremental);
+		args.erase(args.begin());
+	}
+	if (!args.empty() && args[0] == "--suite") {
+		const auto depth = (args.size() > 1 ? parse_depth(args[1]) : optional<int>(4));
+		if (!depth) return usage();
+		return run_suite(*depth);
+	}
+	const auto depth = (args.empty() ? nullopt : parse_depth(args[0]));
+	if (!depth) return usage();
+	if (args.size() < 2) return divide(Position::std_start(), *depth);
+	Position::FenError error;
+	const optional<Position> root = Position::from_fen(args[1], &error);
+	if (!root) {
+		cerr << "invalid FEN (" << error.reason << " at offset " << error.offset << ")" << endl;
+		return usage();
+	}
+	return divide(*root, *depth);
+}
@@ -11,13 +11,10 @@ float dsai::material_vf(const AnalysedPosition& ap)
 
 	constexpr array<float, 7> values {0.0f, 1.0f, 2.5f, 3.0f, 5.0f, 9.0f, 0.0f};
 	array<float, 2> totals {0.0f, 0.0f};
-	float ctrl_dif = 0.0f;
+	const float ctrl_dif = ap.ctrl_difference();
 
-	for(Square s : all_squares) {
-		const Piece p = pos.at(s);
-		totals[static_cast<uint8_t>(p.almnt())] += values[static_cast<uint8_t>(p.type())];
-		ctrl_dif += ap.ctrl(Almnt::White, s);
-		ctrl_dif -= ap.ctrl(Almnt::Black, s);
+	for (Almnt a : {Almnt::White, Almnt::Black}) {
+		for (int t = 1; t < 6; t++) totals[as_index(a)] += values[t] * popcount(pos.pieces(a, static_cast<Piece::Type>(t)));
 	}
 
 	float king_ctrl_adj = 0.0;
@@ -48,23 +45,54 @@ float dsai::material_vf(const AnalysedPosition& ap)
 	return totals[0] - totals[1];
 }*/
 
+float dsai::material_pf(const AnalysedPosition& ap, const Move& mv)
+{
+	constexpr array<float, 7> values {0.0f, 1.0f, 2.5f, 3.0f, 5.0f, 9.0f, 0.0f};
+	const Almnt a = ap.pos().to_move();
+
+	float gain = values[static_cast<uint8_t>(mv.captured().type())];
+	if (mv.is_en_passant()) gain += values[1];
+	if (mv.promo_type()) gain += values[static_cast<uint8_t>(*mv.promo_type())] - values[1];
+	//a piece moving onto a square the opponent controls may be lost, unless it is the king which cannot move there
+	const bool attacked = ap.ctrl(!a, mv.final_sq()) > 0;
+	if (attacked) gain -= values[static_cast<uint8_t>(mv.moved().type())];
+	if (ap.ctrl(!a, mv.initial_sq()) > 0 && !attacked) gain += 0.5f * values[static_cast<uint8_t>(mv.moved().type())]; //escaping
+
+	constexpr float gain_scale = 0.4f; //a safe pawn capture is worth ~1.5 quiet moves
+	return expf(gain_scale * max(gain, -5.0f));
+}
+
+float dsai::forcing_pf(const AnalysedPosition& ap, const Move& mv)
+{
+	//called for every move of a position in turn, so its check squares are worked out once and kept until the
+	//position changes. the address is only compared while ap is alive, and the hash tells a new position there apart
+	thread_local const AnalysedPosition* classified = nullptr;
+	thread_local uint64_t classified_hash = 0;
+	thread_local optional<MoveClassifier> classifier;
+	if (&ap != classified || ap.pos().hash() != classified_hash) {
+		classifier.emplace(ap.pos());
+		classified = &ap;
+		classified_hash = ap.pos().hash();
+	}
+	//the check squares miss a castling rook's check and a promotion opening a line through its own square, both
+	//rare enough to play out in full
+	const MoveRecord mr = mv.record();
+	const bool castling = mv.moved().type() == Piece::Type::King && abs((int) mr.final().file() - (int) mr.initial().file()) == 2;
+	const auto played_out = [&] {
+		const Almnt a = ap.pos().to_move();
+		const Position after = mv.apply();
+		return (after.attackers(ap.king_sq(!a), after.occupied()) & after.pieces(a)) != 0;
+	};
+	const bool check = (castling || mr.is_promo() ? played_out() : classifier->gives_check(mr)); //discovered checks too
+	return (check ? 2.0f : 1.0f) * material_pf(ap, mv);
+}
+
 float dsai::king_ctrl_score(const AnalysedPosition& ap, const Almnt a)
 {
 	//const auto& pos = ap.pos();
 	const Square ksq = ap.king_sq(!a);
 	
-	constexpr array<pair<int, int>, 8> trans {
-		make_pair<int>(0,1),make_pair<int>(1,0),make_pair<int>(0,-1),make_pair<int>(-1,0),
-		make_pair<int>(1,1),make_pair<int>(1,-1),make_pair<int>(-1,1),make_pair<int>(-1,-1)
-	};
-	float total {0.0f};
-
-	for (const auto& t : trans) {
-		const auto target = ksq.translate(t.first, t.second);
-		if (target) total += 0.1 * ap.ctrl(a, target.value());
-	}
-
-	return total;
+	return 0.1f * ap.ctrl_sum(a, king_attacks(ksq));
 }
 
 /*float dsai::test_vf(const AnalysedPosition& ap)
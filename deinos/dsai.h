@@ -11,6 +11,8 @@
 namespace dsai {
 	inline float uniform_vf(const algorithm::AnalysedPosition&) {return 0.5;}
 	inline float uniform_pf(const algorithm::AnalysedPosition& ap, const chess::Move&) {return 1.0f / (float) ap.moves().size();};
+	float material_pf(const algorithm::AnalysedPosition& ap, const chess::Move& mv); //favours winning material safely
+	float forcing_pf(const algorithm::AnalysedPosition& ap, const chess::Move& mv); //as material_pf, also favouring checks
 
 	float material_vf(const algorithm::AnalysedPosition& ap);
 	float material_score(const algorithm::AnalysedPosition& ap);
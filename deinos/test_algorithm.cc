@@ -1,6 +1,11 @@
 #include "gtest/gtest.h"
 #include "deinos/chess.h"
 #include "deinos/algorithm.h"
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <thread>
 using namespace std;
 using namespace chess;
 using namespace algorithm;
@@ -66,6 +71,131 @@ TEST(AnalysedPositionTest, Check)
 	EXPECT_TRUE(apos2.illegal_check());
 }
 
+TEST(AnalysedPositionTest, LegalMovesOnly)
+{
+	AnalysedPosition pinned(Position("4k3/4r3/8/8/8/8/4N3/4K3 w - - 0 1"));
+	EXPECT_EQ(pinned.moves().size(), 4);
+	EXPECT_FALSE(pinned.find_record("e2c3"));
+
+	AnalysedPosition check(Position("4k3/8/8/8/8/8/8/r3K2R w K - 0 1"));
+	EXPECT_EQ(check.moves().size(), 3);
+	EXPECT_FALSE(check.find_record("e1g1"));
+	EXPECT_FALSE(check.find_record("e1f1"));
+
+	AnalysedPosition ep_pin(Position("8/8/8/K2pP2r/8/8/8/7k w - d6 0 1")); //en passant would expose the king
+	EXPECT_FALSE(ep_pin.find_record("e5d6"));
+	EXPECT_TRUE(ep_pin.find_record("e5e6"));
+
+	AnalysedPosition most(Position("R6R/3Q4/1Q4Q1/4Q3/2Q4Q/Q4Q2/pp1Q4/kBNN1KB1 w - - 0 1")); //the most of any reachable position
+	EXPECT_EQ(most.moves().size(), static_cast<ptrdiff_t>(MoveList::inline_capacity));
+	AnalysedPosition unreachable(Position("3Q4/1Q4Q1/4Q3/2Q4Q/Q4Q2/3Q4/1Q4Q1/k3Q2K w - - 0 1")); //twelve queens
+	EXPECT_GT(unreachable.moves().size(), static_cast<ptrdiff_t>(MoveList::inline_capacity));
+}
+
+TEST(AnalysedPositionTest, AdvanceMatchesRebuild)
+{
+	const auto sorted_names = [](gsl::span<const MoveRecord> moves) {
+		vector<string> out;
+		for (const auto& mr : moves) out.push_back(mr.to_string());
+		sort(out.begin(), out.end());
+		return out;
+	};
+
+	const vector<string> starts {
+		Position::std_start().as_fen(),
+		"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+		"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+		"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+	};
+	mt19937 rng(20181022);
+	for (int game = 0; game < 200; game++) {
+		AnalysedPosition apos((Position(starts[game % starts.size()])));
+		for (int ply = 0; ply < 300 && !apos.moves().empty(); ply++) {
+			const MoveRecord mr = apos.moves()[uniform_int_distribution<int>(0, apos.moves().size() - 1)(rng)];
+			const AnalysedPosition rebuilt(Move(apos.pos(), mr).apply());
+			apos.advance_by(mr);
+
+			ASSERT_EQ(apos.pos().as_fen(), rebuilt.pos().as_fen());
+			ASSERT_EQ(apos.pos().hash(), rebuilt.pos().hash());
+			ASSERT_EQ(sorted_names(apos.moves()), sorted_names(rebuilt.moves())) << apos.pos().as_fen();
+			for (Almnt a : {Almnt::White, Almnt::Black}) {
+				ASSERT_EQ(apos.king_sq(a), rebuilt.king_sq(a));
+				for (Square s : all_squares) ASSERT_EQ(apos.ctrl(a, s), rebuilt.ctrl(a, s)) << apos.pos().as_fen();
+			}
+		}
+	}
+}
+
+TEST(AnalysedPositionTest, StagedMovesMatchLegalMoves)
+{
+	mt19937 rng(404);
+	AnalysedPosition apos(Position("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1"));
+	for (int ply = 0; ply < 150 && !apos.moves().empty(); ply++) {
+		const MoveClassifier classifier(apos.pos());
+		StagedMoves staged(apos.pos());
+		vector<string> names;
+		int last_stage = 0;
+		while (const auto mr = staged.next()) {
+			names.push_back(mr->to_string());
+			const int stage = static_cast<int>(staged.stage());
+			ASSERT_GE(stage, last_stage);
+			last_stage = stage;
+			ASSERT_EQ(staged.stage() == StagedMoves::Stage::Captures, classifier.capture(*mr)) << apos.pos().as_fen();
+			if (staged.stage() == StagedMoves::Stage::Checks) {ASSERT_TRUE(classifier.gives_check(*mr));}
+		}
+		EXPECT_EQ(staged.stage(), StagedMoves::Stage::Done);
+
+		vector<string> expected;
+		for (const auto& mr : apos.moves()) expected.push_back(mr.to_string());
+		sort(names.begin(), names.end());
+		sort(expected.begin(), expected.end());
+		ASSERT_EQ(names, expected) << apos.pos().as_fen();
+
+		const MoveRecord mr = apos.moves()[uniform_int_distribution<int>(0, apos.moves().size() - 1)(rng)];
+		apos.advance_by(mr);
+	}
+}
+
+TEST(AnalysedPositionTest, OrderMoves)
+{
+	AnalysedPosition apos(Position("4k3/8/8/8/R2p4/8/8/7K w - - 0 1"));
+	apos.order_moves();
+	const MoveClassifier classifier(apos.pos());
+	const auto moves = apos.moves();
+	ASSERT_GE(moves.size(), 3);
+	EXPECT_EQ(moves[0], MoveRecord("a4", "d4"));
+	EXPECT_EQ(moves[1], MoveRecord("a4", "a8"));
+	for (int i = 2; i < moves.size(); i++) EXPECT_FALSE(classifier.capture(moves[i]) || classifier.gives_check(moves[i]));
+}
+
+TEST(AnalysedPositionTest, MakeUnmakeRestores)
+{
+	const auto snapshot = [](const AnalysedPosition& ap) {
+		vector<string> out {ap.pos().as_fen()};
+		for (const auto& mr : ap.moves()) out.push_back(mr.to_string());
+		for (Almnt a : {Almnt::White, Almnt::Black}) {
+			for (Square s : all_squares) out.push_back(to_string(ap.ctrl(a, s)));
+		}
+		return out;
+	};
+
+	mt19937 rng(1995);
+	AnalysedPosition apos(Position("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1"));
+	for (int walk = 0; walk < 200; walk++) {
+		const auto before = snapshot(apos);
+		vector<AnalysedPosition::Undo> undos;
+		for (int ply = 0; ply < 12 && !apos.moves().empty(); ply++) {
+			const MoveRecord mr = apos.moves()[uniform_int_distribution<int>(0, apos.moves().size() - 1)(rng)];
+			undos.push_back(apos.make_move(mr));
+		}
+		while (!undos.empty()) {
+			apos.unmake_move(undos.back());
+			undos.pop_back();
+		}
+		ASSERT_EQ(snapshot(apos), before);
+	}
+}
+
 TEST(AnalysedPositionTest, Occlusion1)
 {
 	AnalysedPosition apos(Position("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"));
@@ -108,6 +238,157 @@ TEST(AnalysedPositionTest, Occlusion3)
 	//cerr << apos;
 }
 
+TEST(NodePoolTest, RecyclesFreedBlocks)
+{
+	NodePool pool;
+	void* const first = pool.allocate(100);
+	void* const second = pool.allocate(100);
+	EXPECT_EQ(static_cast<std::byte*>(second) - static_cast<std::byte*>(first), 2 * (ptrdiff_t) NodePool::granularity);
+	EXPECT_EQ(reinterpret_cast<uintptr_t>(first) % NodePool::granularity, 0u);
+
+	const NodePool::Block freed[] = {{first, 100}};
+	pool.deallocate(freed);
+	EXPECT_EQ(pool.used_bytes(), 2 * NodePool::granularity);
+	EXPECT_EQ(pool.allocate(128), first); //same size class
+	EXPECT_EQ(pool.used_bytes(), 4 * NodePool::granularity);
+	EXPECT_EQ(pool.reserved_bytes(), NodePool::slab_size);
+}
+
+TEST(NodePoolTest, ReusesLargerAndForeignBlocks)
+{
+	NodePool pool;
+	void* const wide = pool.allocate(4 * NodePool::granularity);
+	pool.allocate(NodePool::granularity); //keeps the cursor past the wide block
+	thread([&] {
+		const NodePool::Block freed[] = {{wide, 4 * NodePool::granularity}};
+		pool.deallocate(freed);
+	}).join();
+
+	//split by whichever thread needs it, the rest staying free
+	void* front = nullptr;
+	void* back = nullptr;
+	thread([&] {front = pool.allocate(2 * NodePool::granularity);}).join();
+	thread([&] {back = pool.allocate(2 * NodePool::granularity);}).join();
+	EXPECT_EQ(front, wide);
+	EXPECT_EQ(static_cast<std::byte*>(back) - static_cast<std::byte*>(front), 2 * (ptrdiff_t) NodePool::granularity);
+	EXPECT_EQ(pool.used_bytes(), 5 * NodePool::granularity);
+	EXPECT_EQ(pool.reserved_bytes(), NodePool::slab_size);
+}
+
+TEST(NodePoolTest, MergesFreeBlocksWithinTheLimit)
+{
+	MemoryAccount account;
+	account.set_limit(NodePool::slab_size);
+	NodePool pool(&account);
+	constexpr size_t lines = NodePool::slab_size / NodePool::granularity;
+	vector<void*> blocks;
+	for (size_t i = 0; i < lines / 4; i++) blocks.push_back(pool.allocate(4 * NodePool::granularity, true));
+	EXPECT_EQ(account.held(), NodePool::slab_size);
+	EXPECT_EQ(pool.allocate(NodePool::granularity, true), nullptr); //the slab is full and no other fits the limit
+
+	//freed in pieces from two threads, so neither shard holds a run of neighbours
+	for (int parity = 0; parity < 2; parity++) {
+		thread([&] {
+			vector<NodePool::Block> freed;
+			for (size_t i = parity; i < blocks.size(); i += 2) freed.push_back({blocks[i], 4 * NodePool::granularity});
+			pool.deallocate(freed);
+		}).join();
+	}
+	EXPECT_EQ(pool.allocate(8 * NodePool::granularity, true), nullptr);
+	pool.merge_free();
+	EXPECT_EQ(pool.allocate(NodePool::slab_size, true), blocks[0]);
+	EXPECT_EQ(pool.reserved_bytes(), NodePool::slab_size);
+}
+
+TEST(NodeTest, SelectEdgeWhileUpdated)
+{
+	//run under ThreadSanitizer, the vector paths must not race with the updates
+	constexpr int size = 37;
+	const int padded = EdgeArrays::padded(size);
+	vector<int32_t> visits(padded);
+	vector<float> values(padded);
+	vector<uint16_t> priors(padded, pack_prior(1.0f));
+	EdgeArrays edges {size, visits.data(), values.data(), priors.data(), nullptr};
+
+	constexpr int updates = 20000;
+	vector<thread> writers;
+	for (int t = 0; t < 2; t++) {
+		writers.emplace_back([&, t] {
+			for (int n = 0; n < updates; n++) {
+				const int i = (n * 7 + t) % size;
+				edges.add_visits(i, 1);
+				edges.add_value(i, (i == 5 ? 1.0f : 0.25f));
+			}
+		});
+	}
+	atomic<int> finished{0};
+	vector<thread> readers;
+	for (int t = 0; t < 2; t++) {
+		readers.emplace_back([&] {
+			for (int n = 0; n < updates; n++) {
+				const int i = select_edge(edges, true, 0.1f);
+				if (i < 0 || i >= size) return;
+				if (value_sum(edges) < 0.0f) return;
+			}
+			finished++;
+		});
+	}
+	for (thread& t : writers) t.join();
+	for (thread& t : readers) t.join();
+	EXPECT_EQ(finished, 2);
+	int total = 0;
+	for (int i = 0; i < size; i++) total += edges.visit_count(i);
+	EXPECT_EQ(total, 2 * updates);
+	EXPECT_EQ(select_edge(edges, true, 0.1f), 5); //the only edge with a mean of 1
+}
+
+TEST(NodeTest, FullNodeKeepsOnlyTheBoard)
+{
+	NodePool pool;
+	AnalysedPosition apos(Position::std_start());
+	const NodePtr full = Node::create(pool, apos);
+	const size_t full_bytes = pool.used_bytes();
+	const NodePtr compact = Node::create(pool, apos, true);
+	EXPECT_LE(full_bytes - (pool.used_bytes() - full_bytes), sizeof(AnalysedBoard) + NodePool::granularity);
+	EXPECT_EQ(full->board->pos(), apos.pos());
+	for (int i = 0; i < full->edges_num(); i++) {
+		EXPECT_EQ(full->edge_move(i), apos.moves()[i]);
+		EXPECT_EQ(compact->edge_move(i), apos.moves()[i]);
+	}
+}
+
+TEST(NodeTest, SelectEdgeMatchesScalarScore)
+{
+	mt19937 gen(7);
+	uniform_int_distribution<int> visit_dist(0, 6);
+	uniform_int_distribution<int> prior_dist(1, 3);
+	for (int size = 1; size <= 40; size++) {
+		const int padded = EdgeArrays::padded(size);
+		vector<int32_t> visits(padded);
+		vector<float> values(padded);
+		vector<uint16_t> priors(padded, pack_prior(1.0f));
+		for (int i = 0; i < size; i++) {
+			visits[i] = visit_dist(gen);
+			values[i] = 0.5f * visit_dist(gen) * (visits[i] > 0); //coarse values so that ties occur
+			priors[i] = pack_prior(0.5f * prior_dist(gen)); //exact in bfloat16
+		}
+		const EdgeArrays edges {size, visits.data(), values.data(), priors.data(), nullptr};
+
+		for (bool white : {true, false}) {
+			int expected = 0;
+			float best = -INFINITY;
+			for (int i = 0; i < size; i++) {
+				const float visits_f = visits[i];
+				const float q = (white ? 0.0f : 1.0f) + (white ? 1.0f : -1.0f) * (values[i] / max(visits_f, 1.0f));
+				const float score = q + 0.7f * unpack_prior(priors[i]) / (1.0f + visits_f);
+				if (score > best) {best = score; expected = i;}
+			}
+			EXPECT_EQ(select_edge(edges, white, 0.7f), expected) << "size " << size;
+		}
+		EXPECT_FLOAT_EQ(value_sum(edges), accumulate(values.begin(), values.end(), 0.0f));
+	}
+}
+
 TEST(TreeTest, Stalemate)
 {
 	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
@@ -165,4 +446,357 @@ TEST(TreeTest, AvoidMateInOne)
 	const string name = (string) mv;
 	const bool success = (name == "Pf7-f6" || name == "Ne7-f5");
 	EXPECT_TRUE(success);
-}
\ No newline at end of file
+}
+
+TEST(TreeTest, ConcurrentSearchKeepsCounts)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+
+	Tree tree(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri);
+	tree.virtual_loss = 3;
+	vector<thread> threads;
+	for (int t = 0; t < 4; t++) threads.emplace_back([&]() {for (int i = 0; i < 2000; i++) tree.search();});
+	for (auto& t : threads) t.join();
+
+	EXPECT_EQ(tree.base->total_n(), 1 + 4 * 2000);
+	int children = 0;
+	int visits = 0;
+	for (int i = 0; i < tree.base->edges_num(); i++) {
+		const Node* const child = tree.base->child(i);
+		children += (child != nullptr);
+		visits += (child ? child->total_n() : 0);
+	}
+	EXPECT_EQ(children, 20);
+	EXPECT_EQ(visits, 4 * 2000); //every virtual loss has been withdrawn
+}
+
+TEST(TreeTest, TranspositionsShareNodes)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+	const auto follow = [](Node* node, const string& name) -> Node* {
+		for (int i = 0; node && i < node->edges_num(); i++) if (node->edge_move(i).to_string() == name) return node->child(i);
+		return nullptr;
+	};
+
+	Tree tree(AnalysedPosition(Position("7k/8/8/8/8/8/P6P/7K w - - 0 1")), dumb_val, dumb_pri);
+	for (int i = 0; i < 5000; i++) tree.search();
+	Node* const first = follow(follow(follow(tree.base.get(), "a2a3"), "h8g8"), "h2h3");
+	Node* const second = follow(follow(follow(tree.base.get(), "h2h3"), "h8g8"), "a2a3");
+	ASSERT_NE(first, nullptr);
+	EXPECT_EQ(first, second);
+}
+
+TEST(TreeTest, CompactNodes)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+
+	AnalysedPosition apos(Position("rnbq1rk1/pp1pnppp/2pb4/1B6/3Q4/1P2P3/PBP2PPP/RN2K1NR w KQ - 0 7"));
+	Tree tree(apos, dumb_val, dumb_pri);
+	tree.compact = true;
+	tree.full_depth = 0;
+	for (int i = 0; i < 1000; i++) tree.search();
+	EXPECT_EQ((string) tree.best_move(), "Qd4xg7");
+
+	//the new base has no position of its own, search continues from the one kept by the tree
+	Tree opening(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri);
+	opening.compact = true;
+	opening.full_depth = 0;
+	for (int i = 0; i < 2000; i++) opening.search();
+	const Position expected = opening.best_move().apply();
+	ASSERT_TRUE(opening.advance_by(opening.best_move()));
+	EXPECT_EQ(opening.base->board, nullptr);
+	EXPECT_EQ(opening.base_apos().pos(), expected);
+	const int visits = opening.base->total_n();
+	for (int i = 0; i < 1000; i++) opening.search();
+	EXPECT_EQ(opening.base->total_n(), visits + 1000);
+	EXPECT_TRUE(AnalysedPosition(expected).find_record(opening.best_move().record().to_string()));
+}
+
+TEST(TreeTest, PruneKeepsEdgeStatistics)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+
+	Tree tree(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri);
+	for (int i = 0; i < 5000; i++) tree.search();
+	const int edges = tree.base->edges_num();
+	vector<int> visits(edges);
+	for (int i = 0; i < edges; i++) visits[i] = tree.base->edge_visits(i);
+
+	const size_t before = tree.memory_live();
+	const size_t held = tree.memory_used();
+	tree.prune(before / 2);
+	EXPECT_LE(tree.memory_live(), before / 2);
+	for (int i = 0; i < edges; i++) EXPECT_EQ(tree.base->edge_visits(i), visits[i]);
+	EXPECT_EQ(tree.base->total_n(), 5001);
+
+	for (int i = 0; i < 1000; i++) tree.search();
+	EXPECT_EQ(tree.base->total_n(), 6001);
+	EXPECT_EQ(tree.memory_used(), held); //the new nodes took freed blocks
+}
+
+TEST(TreeTest, AdvanceReclaimsSiblings)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+
+	Tree tree(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri);
+	for (int i = 0; i < 5000; i++) tree.search();
+	const size_t before = tree.memory_live();
+	const Move mv = tree.best_move();
+	const int visits = tree.base->find_child(mv)->total_n();
+	ASSERT_TRUE(tree.advance_by(mv));
+	EXPECT_EQ(tree.base->total_n(), visits);
+
+	tree.wait_reclaimed();
+	EXPECT_LT(tree.memory_live(), before);
+	for (int i = 0; i < 1000; i++) tree.search();
+	EXPECT_EQ(tree.base->total_n(), visits + 1000);
+}
+
+TEST(TreeTest, AdvanceToUnexpandedChild)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+
+	Tree tree(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri);
+	const Position start = Position::std_start();
+	ASSERT_TRUE(tree.advance_by(Move(start, MoveRecord("e2", "e4"))));
+	EXPECT_EQ(tree.base_apos().pos(), Move(start, MoveRecord("e2", "e4")).apply());
+	const int visits = tree.base->total_n();
+	for (int i = 0; i < 100; i++) tree.search();
+	EXPECT_EQ(tree.base->total_n(), visits + 100);
+}
+
+TEST(TreeTest, PriorsFocusSearch)
+{
+	EXPECT_EQ(unpack_prior(pack_prior(1.5f)), 1.5f);
+	EXPECT_NEAR(unpack_prior(pack_prior(0.1f)), 0.1f, 0.001f);
+
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto favour_e4 = [&] (const AnalysedPosition&, const Move& mv) {return ((string) mv == "Pe2-e4" ? 10.0f : 1.0f);};
+
+	Tree tree(AnalysedPosition(Position::std_start()), dumb_val, favour_e4);
+	for (int i = 0; i < 2000; i++) tree.search();
+	EXPECT_EQ((string) tree.best_move(), "Pe2-e4");
+	const int favoured = tree.base->find_child(tree.best_move())->total_n();
+	for (int i = 0; i < tree.base->edges_num(); i++) {
+		const Node* const child = tree.base->child(i);
+		if (child && child->total_n() != favoured) {
+			EXPECT_LT(2 * child->total_n(), favoured);
+		}
+	}
+}
+
+TEST(TreeTest, BatchedEvaluation)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+	int calls = 0;
+	int evaluated = 0;
+	const auto batch_val = [&] (gsl::span<const AnalysedPosition*> leaves, gsl::span<float> values) {
+		ASSERT_EQ(leaves.size(), values.size());
+		calls++;
+		evaluated += leaves.size();
+		for (int i = 0; i < leaves.size(); i++) values[i] = dumb_val(*leaves[i]);
+	};
+
+	Tree tree(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri);
+	tree.batch_value_fn = batch_val;
+	for (int i = 0; i < 100; i++) tree.search_batch(16);
+	EXPECT_EQ(tree.base->total_n(), 1 + 100 * 16);
+	EXPECT_EQ(calls, 100);
+	EXPECT_GT(evaluated, 100 * 8); //most playouts end in a new leaf rather than a transposition
+
+	AnalysedPosition apos(Position("rnbq1rk1/pp1pnppp/2pb4/1B6/3Q4/1P2P3/PBP2PPP/RN2K1NR w KQ - 0 7"));
+	Tree mate(apos, dumb_val, dumb_pri);
+	mate.batch_value_fn = batch_val;
+	for (int i = 0; i < 100; i++) mate.search_batch(16);
+	EXPECT_EQ((string) mate.best_move(), "Qd4xg7");
+}
+
+TEST(TreeEngineTest, ThreadOptions)
+{
+	EXPECT_EQ(parse_cpu_list("0-3,8"), vector<int>({0, 1, 2, 3, 8}));
+	EXPECT_EQ(parse_cpu_list("5"), vector<int>({5}));
+	EXPECT_FALSE(parse_cpu_list(""));
+	EXPECT_FALSE(parse_cpu_list("3-1"));
+	EXPECT_FALSE(parse_cpu_list("1,x"));
+	EXPECT_FALSE(parse_cpu_list("2-"));
+
+	vector<string> args = {"--threads", "2", "--cpus", "0,1", "extra"};
+	const optional<ThreadOptions> options = parse_thread_options(args);
+	ASSERT_TRUE(options);
+	EXPECT_EQ(options->count, 2);
+	EXPECT_EQ(options->cpus, vector<int>({0, 1}));
+	EXPECT_EQ(args, vector<string>({"extra"}));
+	vector<string> bad = {"--threads", "-1"};
+	EXPECT_FALSE(parse_thread_options(bad));
+
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+	TreeEngine engine(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri, 0.3, 3, *options);
+	EXPECT_EQ(engine.thread_count(), 2);
+}
+
+TEST(ThreadPoolTest, RunsNestedTasksAndCancels)
+{
+	ThreadOptions options;
+	options.count = 3;
+	ThreadPool pool(options);
+	EXPECT_EQ(pool.size(), 3);
+
+	atomic<int> done{0};
+	for (int i = 0; i < 50; i++) {
+		pool.submit([&]() {
+			for (int j = 0; j < 4; j++) pool.submit([&]() {done++;}); //queued on the worker, stolen by the others
+			done++;
+		});
+	}
+	pool.wait_idle();
+	EXPECT_EQ(done, 50 * 5);
+
+	//a task that requeues itself until its token is cancelled
+	CancellationToken token;
+	atomic<int> rounds{0};
+	function<void()> repeat = [&]() {
+		if (token.cancelled()) return;
+		rounds++;
+		pool.submit(repeat);
+	};
+	pool.submit(repeat);
+	while (rounds < 100) this_thread::yield();
+	token.cancel();
+	pool.wait_idle();
+	const int stopped = rounds;
+	this_thread::sleep_for(1ms);
+	EXPECT_EQ(rounds, stopped);
+}
+
+TEST(TreeEngineTest, AdvanceWhileSearching)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+	ThreadOptions options;
+	options.count = 2;
+
+	TreeEngine engine(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri, 0.3, 3, options);
+	for (int ply = 0; ply < 4; ply++) {
+		while (engine.total_n() < 3000) this_thread::sleep_for(1ms);
+		const Position expected = engine.choose_move().apply();
+		ASSERT_TRUE(engine.advance_by(engine.choose_move()));
+		EXPECT_TRUE(AnalysedPosition(expected).find_record(engine.choose_move().record().to_string()));
+	}
+}
+
+TEST(TreeEngineTest, MemoryBudget)
+{
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+	ThreadOptions options;
+	options.count = 2;
+	TreeEngine engine(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri, 0.3, 3, options);
+	const size_t budget = 8 * NodePool::slab_size;
+	engine.set_memory_budget(budget);
+
+	SearchLimits nodes;
+	nodes.nodes = 40000; //several times what fits
+	nodes.early_stop = false;
+	engine.search_until(nodes);
+	EXPECT_LE(engine.memory_live(), budget);
+	EXPECT_LE(engine.memory_used(), budget);
+
+	//pruning trims the least visited subtrees rather than halving the tree, so it stays close to the budget
+	size_t low = SIZE_MAX;
+	bool filled = false;
+	while (engine.completed_n() < 120000) {
+		const size_t live = engine.memory_live();
+		filled = filled || live > budget / 4 * 3;
+		if (filled) low = min(low, live);
+		this_thread::sleep_for(100us);
+	}
+	EXPECT_TRUE(filled);
+	EXPECT_GT(low, budget / 8 * 5);
+	EXPECT_LE(engine.memory_used(), budget);
+}
+
+TEST(TreeEngineTest, SearchLimits)
+{
+	SearchLimits clock;
+	clock.time_left = 30050ms;
+	EXPECT_EQ(allocate_time(clock), 1000ms); //a thirtieth of what is left after the overhead
+	clock.increment = 2000ms;
+	EXPECT_EQ(allocate_time(clock), 2500ms);
+	clock.time_left = 1050ms;
+	EXPECT_EQ(allocate_time(clock), 750ms); //never more than three quarters of the clock
+	EXPECT_FALSE(allocate_time(SearchLimits()));
+
+	const auto dumb_val = [&] (const AnalysedPosition& ) {return 0.5;};
+	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
+	ThreadOptions options;
+	options.count = 2;
+	TreeEngine engine(AnalysedPosition(Position::std_start()), dumb_val, dumb_pri, 0.3, 3, options);
+
+	SearchLimits nodes;
+	nodes.nodes = 5000;
+	nodes.early_stop = false;
+	engine.search_until(nodes);
+	EXPECT_GE(engine.completed_n(), 5000);
+
+	//a single legal move is played at once
+	TreeEngine forced(AnalysedPosition(Position("k7/8/8/8/8/8/6q1/7K w - - 0 1")), dumb_val, dumb_pri, 0.3, 3, options);
+	SearchLimits slow;
+	slow.move_time = 10000ms;
+	const auto start = chrono::steady_clock::now();
+	EXPECT_EQ((string) forced.search_until(slow), "Kh1xg2");
+	EXPECT_LT(chrono::steady_clock::now() - start, 1000ms);
+
+	//a mate in one takes nearly every visit, so the search stops once the rest of the budget could not change that
+	TreeEngine mate(AnalysedPosition(Position("rnbq1rk1/pp1pnppp/2pb4/1B6/3Q4/1P2P3/PBP2PPP/RN2K1NR w KQ - 0 7")), dumb_val, dumb_pri, 0.3, 3, options);
+	SearchLimits playouts;
+	playouts.playouts = 200000;
+	const int before = mate.total_n();
+	EXPECT_EQ((string) mate.search_until(playouts), "Qd4xg7");
+	EXPECT_LT(mate.total_n() - before, 150000);
+}
+
+TEST(TreeEngineTest, XboardClock)
+{
+	XboardClock clock(20000ms);
+	EXPECT_EQ(clock.limits().move_time, 20000ms);
+	EXPECT_TRUE(clock.command("time 6000"));
+	EXPECT_FALSE(clock.limits().move_time); //the default gives way to the clock
+
+	//st holds over the clock until a level arrives
+	EXPECT_TRUE(clock.command("st 5"));
+	EXPECT_TRUE(clock.command("time 6000"));
+	EXPECT_EQ(clock.limits().move_time, 5000ms);
+	EXPECT_EQ(allocate_time(clock.limits()), 5000ms);
+
+	//40 moves in 5 minutes, counted down as they are played
+	EXPECT_TRUE(clock.command("level 40 5 0"));
+	EXPECT_FALSE(clock.limits().move_time);
+	EXPECT_EQ(clock.limits().time_left, 300000ms);
+	EXPECT_EQ(clock.limits().moves_to_go, 40);
+	for (int i = 0; i < 39; i++) clock.move_played();
+	EXPECT_EQ(clock.limits().moves_to_go, 1);
+	EXPECT_TRUE(clock.command("time 1005"));
+	EXPECT_EQ(allocate_time(clock.limits()), 7500ms); //three quarters of the clock
+	clock.move_played();
+	EXPECT_EQ(clock.limits().moves_to_go, 40); //the next control
+
+	EXPECT_TRUE(clock.command("level 0 2:30 1.5"));
+	EXPECT_EQ(clock.limits().time_left, 150000ms);
+	EXPECT_EQ(clock.limits().increment, 1500ms);
+	EXPECT_EQ(clock.limits().moves_to_go, 0);
+	clock.move_played();
+	EXPECT_EQ(clock.limits().moves_to_go, 0);
+
+	EXPECT_FALSE(clock.command("level 40 5"));
+	EXPECT_FALSE(clock.command("level 40 2;30 0"));
+	EXPECT_FALSE(clock.command("st x"));
+	EXPECT_FALSE(clock.command("go"));
+}
@@ -2,6 +2,8 @@
 #include "deinos/chess.h"
 #include <string>
 #include <optional>
+#include <vector>
+#include <random>
 using namespace std;
 using namespace chess;
 
@@ -115,6 +117,21 @@ TEST(MoveRecordTest, ToString)
 	EXPECT_EQ(mr.to_string(), "c7c8R");
 }
 
+TEST(MoveListTest, EraseAndCopy)
+{
+	MoveList list;
+	list.emplace_back(Square("e2"), Square("e4"));
+	list.emplace_back(Square("d2"), Square("d4"));
+	list.emplace_back(Square("c7"), Square("c8"), Piece::Type::Queen);
+	const auto is_pawn_push = [](MoveRecord mr) {return !mr.is_promo();};
+	MoveList copy = list;
+	list.erase(remove_if(list.begin(), list.end(), is_pawn_push), list.end());
+	ASSERT_EQ(list.size(), 1u);
+	EXPECT_EQ(list[0], MoveRecord("c7", "c8", Piece::Type::Queen));
+	ASSERT_EQ(copy.size(), 3u);
+	EXPECT_EQ(copy[1], MoveRecord("d2", "d4"));
+}
+
 TEST(HalfByteBoardTest, Indexing)
 {
 	HalfByteBoard hbb;
@@ -129,6 +146,81 @@ TEST(HalfByteBoardTest, Indexing)
 	EXPECT_EQ(hbb.get(63), 6);
 }
 
+TEST(HalfByteBoardTest, BulkOperations)
+{
+	HalfByteBoard hbb;
+	array<int, 64> expected = {};
+	mt19937_64 rng(7);
+	for (int i = 0; i < 200; i++) {
+		const Bitboard squares = rng() & rng();
+		Bitboard add = 0;
+		Bitboard sub = 0;
+		for (int s = 0; s < 64; s++) {
+			if (!(squares & square_bb(s))) continue;
+			if (expected[s] < 15 && (i % 3 != 2 || expected[s] == 0)) {add |= square_bb(s); expected[s]++;}
+			else if (expected[s] > 0) {sub |= square_bb(s); expected[s]--;}
+		}
+		hbb.add(add);
+		hbb.sub(sub);
+
+		const Bitboard mask = rng();
+		int total = 0;
+		int masked = 0;
+		Bitboard nonzero = 0;
+		for (int s = 0; s < 64; s++) {
+			ASSERT_EQ(hbb.get(s), expected[s]);
+			total += expected[s];
+			if (mask & square_bb(s)) masked += expected[s];
+			if (expected[s] > 0) nonzero |= square_bb(s);
+		}
+		EXPECT_EQ(hbb.sum(), total);
+		EXPECT_EQ(hbb.sum(mask), masked);
+		EXPECT_EQ(hbb.nonzero(), nonzero);
+	}
+}
+
+TEST(BitboardTest, SlidingAttacks)
+{
+	const Bitboard occupied = square_bb(Square("c4")) | square_bb(Square("c7")) | square_bb(Square("f4"));
+	const Bitboard rook = rook_attacks(Square("c4"), occupied);
+	EXPECT_EQ(popcount(rook), 11);
+	EXPECT_TRUE(rook & square_bb(Square("f4")));
+	EXPECT_FALSE(rook & square_bb(Square("g4")));
+	EXPECT_TRUE(rook & square_bb(Square("c7")));
+	EXPECT_FALSE(rook & square_bb(Square("c8")));
+	EXPECT_EQ(bishop_attacks(Square("a1"), 0), bishop_attacks(Square("a1"), square_bb(Square("a1"))));
+	EXPECT_EQ(popcount(bishop_attacks(Square("a1"), 0)), 7);
+	EXPECT_EQ(popcount(queen_attacks(Square("d4"), 0)), 27);
+}
+
+TEST(BitboardTest, JumpAttacks)
+{
+	EXPECT_EQ(popcount(knight_attacks(Square("a1"))), 2);
+	EXPECT_EQ(popcount(knight_attacks(Square("e4"))), 8);
+	EXPECT_EQ(popcount(king_attacks(Square("h8"))), 3);
+	EXPECT_EQ(pawn_attacks(Almnt::White, Square("a2")), square_bb(Square("b3")));
+	EXPECT_EQ(pawn_attacks(Almnt::Black, Square("e5")), square_bb(Square("d4")) | square_bb(Square("f4")));
+}
+
+TEST(BitboardTest, PawnPushesAndRays)
+{
+	static_assert(tables::knight[0] == ((Bitboard{1} << 10) | (Bitboard{1} << 17)));
+	EXPECT_EQ(pawn_pushes(Almnt::White, Square("e2")), square_bb(Square("e3")) | square_bb(Square("e4")));
+	EXPECT_EQ(pawn_pushes(Almnt::Black, Square("e6")), square_bb(Square("e5")));
+	EXPECT_EQ(pawn_pushes(Almnt::White, Square("e8")), 0u);
+
+	const Ray& r = ray(1, Square("c1")); //north east
+	ASSERT_EQ(r.length, 5);
+	EXPECT_EQ(r.squares[0], Square("d2"));
+	EXPECT_EQ(r.squares[4], Square("h6"));
+	EXPECT_EQ(ray(6, Square("a4")).length, 0); //west off the board
+	for (Square s : all_squares) {
+		Bitboard from_rays = 0;
+		for (int dir = 0; dir < 8; dir += 2) for (Square t : ray(dir, s)) from_rays |= square_bb(t);
+		EXPECT_EQ(from_rays, rook_attacks(s, 0));
+	}
+}
+
 TEST(PositionTest, FenConstruction)
 {
 	Position pos("r3kb1r/1bq2ppp/p1nppn2/8/1p1NP3/P1N1BP2/1PPQB1PP/2KR3R w kq - 0 12");
@@ -136,6 +228,35 @@ TEST(PositionTest, FenConstruction)
 	EXPECT_EQ(pos.as_fen(), "r3kb1r/1bq2ppp/p1nppn2/8/1p1NP3/P1N1BP2/1PPQB1PP/2KR3R w kq - 0 12");
 }
 
+TEST(PositionTest, FenParsing)
+{
+	const auto pos = Position::from_fen("rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq e6 0 2");
+	ASSERT_TRUE(pos);
+	EXPECT_EQ(pos->en_passant_target(), Square("e6"));
+	EXPECT_EQ(pos->fm_count(), 2);
+	const auto no_clocks = Position::from_fen("8/8/8/8/8/8/8/K6k b - -");
+	ASSERT_TRUE(no_clocks);
+	EXPECT_EQ(no_clocks->as_fen(), "8/8/8/8/8/8/8/K6k b - - 0 1");
+
+	Position::FenError error;
+	EXPECT_FALSE(Position::from_fen("rnbqkbnr/pppppppp/9/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", &error));
+	EXPECT_EQ(error.offset, 18u);
+	EXPECT_FALSE(Position::from_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQxq - 0 1", &error));
+	EXPECT_EQ(error.offset, 48u);
+	EXPECT_FALSE(Position::from_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP w KQkq - 0 1", &error));
+	EXPECT_FALSE(Position::from_fen("", &error));
+	EXPECT_THROW(Position("8/8/8/8/8/8/8/K6k x - - 0 1"), std::invalid_argument);
+}
+
+TEST(PositionTest, FenWriting)
+{
+	Position::FenBuffer buffer;
+	const string longest = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR b KQkq e3 32767 32767";
+	static_assert(Position::max_fen_length == 93);
+	EXPECT_EQ(Position(longest).write_fen(buffer), longest);
+	EXPECT_EQ(Position::std_start().write_fen(buffer), Position::std_start().as_fen());
+}
+
 TEST(PositionTest, ToMove)
 {
 	Position defpos = Position::std_start();
@@ -156,6 +277,75 @@ TEST(PositionTest, Indexing)
 	EXPECT_EQ(pos2.at("c3"), new_p);
 }
 
+TEST(PositionTest, Bitboards)
+{
+	Position pos = Position::std_start();
+	EXPECT_EQ(pos.occupied(), rank_bb(0) | rank_bb(1) | rank_bb(6) | rank_bb(7));
+	EXPECT_EQ(pos.pieces(Almnt::Black, Piece::Type::Pawn), rank_bb(6));
+	EXPECT_EQ(pos.pieces(Almnt::White, Piece::Type::King), square_bb(Square("e1")));
+	pos = Position(pos, Move(pos, MoveRecord("g1", "f3")));
+	EXPECT_EQ(pos.pieces(Almnt::White, Piece::Type::Knight), square_bb(Square("b1")) | square_bb(Square("f3")));
+	pos.set("f3", Piece());
+	EXPECT_EQ(pos.pieces(Piece::Type::Knight), square_bb(Square("b1")) | (rank_bb(7) & (file_bb(1) | file_bb(6))));
+	EXPECT_EQ(popcount(pos.pieces(Almnt::White)), 15);
+}
+
+TEST(PositionTest, HashTransposition)
+{
+	const auto play = [](Position pos, const vector<MoveRecord>& records) {
+		for (const auto& mr : records) pos = Position(pos, Move(pos, mr));
+		return pos;
+	};
+	const Position start = Position::std_start();
+	const Position p1 = play(start, {{"g1", "f3"}, {"g8", "f6"}, {"b1", "c3"}});
+	const Position p2 = play(start, {{"b1", "c3"}, {"g8", "f6"}, {"g1", "f3"}});
+	EXPECT_EQ(p1.hash(), p2.hash());
+	EXPECT_EQ(p1, p2);
+	EXPECT_EQ(p1.hash(), Position(p1.as_fen()).hash());
+	EXPECT_NE(p1.hash(), play(start, {{"g1", "f3"}, {"g8", "f6"}, {"b1", "a3"}}).hash());
+	EXPECT_NE(start.hash(), Position("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR b KQkq - 0 1").hash());
+	EXPECT_NE(start.hash(), Position("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQk - 0 1").hash());
+}
+
+TEST(PositionTest, HashSpecialMoves)
+{
+	const auto check = [](const string& fen, MoveRecord mr) {
+		const Position pos(fen);
+		const Position next(pos, Move(pos, mr));
+		EXPECT_EQ(next.hash(), Position(next.as_fen()).hash()) << fen << " " << mr;
+	};
+	check("r2qkbnr/pp1n1ppp/3pp3/2p5/4P3/3P1N2/PPP2PPP/RNBQK2R w KQkq - 0 6", {"e1", "g1"});
+	check("rnbqkbnr/pp2pppp/8/2pP4/8/8/PPPP1PPP/RNBQKBNR w KQkq c6 0 3", {"d5", "c6"});
+	check("r2qkbnr/pP2pppp/2n5/5b2/8/8/PPPP1PPP/RNBQKBNR w KQkq - 1 5", {"b7", "a8", Piece::Type::Queen});
+	check("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", {"e2", "e4"});
+
+	const Position with_ep("rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1");
+	const Position without_ep("rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1");
+	EXPECT_NE(with_ep.hash(), without_ep.hash());
+	EXPECT_EQ(with_ep.hash_bar_ep(), without_ep.hash_bar_ep());
+}
+
+TEST(PositionTest, MakeUnmake)
+{
+	const auto check = [](const string& fen, MoveRecord mr) {
+		Position pos(fen);
+		const Position applied(pos, Move(pos, mr));
+		const auto undo = pos.make_move(mr);
+		EXPECT_EQ(pos.as_fen(), applied.as_fen()) << fen << " " << mr;
+		EXPECT_EQ(pos.hash(), applied.hash());
+		pos.unmake_move(undo);
+		EXPECT_EQ(pos.as_fen(), fen) << mr;
+		EXPECT_EQ(pos.hash(), Position(fen).hash());
+		EXPECT_EQ(pos.occupied(), Position(fen).occupied());
+	};
+	check("r2qkbnr/pp1n1ppp/3pp3/2p5/4P3/3P1N2/PPP2PPP/RNBQK2R w KQkq - 0 6", {"e1", "g1"});
+	check("r3k2r/pppppppp/8/8/8/8/PPPPPPPP/R3K2R b KQkq - 3 9", {"e8", "c8"});
+	check("rnbqkbnr/pp2pppp/8/2pP4/8/8/PPPP1PPP/RNBQKBNR w KQkq c6 0 3", {"d5", "c6"});
+	check("r2qkbnr/pP2pppp/2n5/5b2/8/8/PPPP1PPP/RNBQKBNR w KQkq - 1 5", {"b7", "a8", Piece::Type::Queen});
+	check("rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1", {"g8", "f6"});
+	check("r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1", {"a1", "a8"});
+}
+
 TEST(PositionTest, CastleFlags)
 {
 	Position pos;
@@ -166,6 +356,17 @@ TEST(PositionTest, CastleFlags)
 	EXPECT_TRUE(pos.can_castle(a, s));
 }
 
+TEST(PositionTest, CastleFlagsRookOffCorner)
+{
+	Position pos("r3k2r/8/8/R7/8/8/8/R3K2R w KQkq - 0 1");
+	pos = Position(pos, Move(pos, MoveRecord("a5", "a6")));
+	EXPECT_TRUE(pos.can_castle(Almnt::White, Side::Queenside));
+	pos = Position(pos, Move(pos, MoveRecord("h8", "h1")));
+	EXPECT_FALSE(pos.can_castle(Almnt::White, Side::Kingside));
+	EXPECT_FALSE(pos.can_castle(Almnt::Black, Side::Kingside));
+	EXPECT_TRUE(pos.can_castle(Almnt::Black, Side::Queenside));
+}
+
 TEST(PositionTest, AsFen)
 {
 	auto pos = Position::std_start();
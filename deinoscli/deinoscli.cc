@@ -11,7 +11,14 @@ using namespace algorithm;
 using namespace std::chrono_literals;
 using std::chrono::system_clock;
 
-int main() {
+int main(int argc, char* argv[]) {
+	vector<string> args(argv + 1, argv + argc);
+	const optional<ThreadOptions> threads = parse_thread_options(args);
+	if (!threads || !args.empty()) {
+		cerr << "usage: deinoscli [--threads N] [--cpus LIST]" << endl;
+		return 2;
+	}
+
 	//chess::Position pos = chess::Position::std_start();
 	//algorithm::RandomEngine rengine;
 	//algorithm::Engine& engine = rengine;
@@ -91,8 +98,9 @@ int main() {
 	//pos["b8"] = Piece();
 	AnalysedPosition start_pos(pos);
 	const auto dumb_val = dsai::material_vf;//= [&] (const AnalysedPosition&) {return 0.5;};
-	const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (float) ap.moves().size();};
-	TreeEngine engine(start_pos, dumb_val, dumb_pri, 0.3);
+	const auto dumb_pri = dsai::forcing_pf;//= [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (float) ap.moves().size();};
+	TreeEngine engine(start_pos, dumb_val, dumb_pri, 0.3, 3, *threads);
+	cout << "search threads: " << engine.thread_count() << endl;
 
 	cout << dumb_val(start_pos) << endl;
 
@@ -111,5 +119,4 @@ int main() {
 
 	cout << "sizeof AnPos: " << sizeof(AnalysedPosition) << endl;
 	cout << "sizeof Node: " << sizeof(Node) << endl;
-	cout << "sizeof Edge: " << sizeof(Edge) << endl;
 }
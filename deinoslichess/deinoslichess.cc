@@ -10,14 +10,22 @@ using namespace algorithm;
 using namespace std::chrono_literals;
 using std::chrono::system_clock;
 
-int main() {
+int main(int argc, char* argv[]) {
+	vector<string> args(argv + 1, argv + argc);
+	const optional<ThreadOptions> threads = parse_thread_options(args);
+	if (!threads || !args.empty()) {
+		cerr << "usage: deinoslichess [--threads N] [--cpus LIST]" << endl;
+		return 2;
+	}
+
 	//const auto dumb_val = [&] (const AnalysedPosition&) {return 0.5;};
 	//const auto dumb_pri = [&] (const AnalysedPosition& ap, const Move&) {return 1.0 / (double) ap.moves().size();};
 	const auto dumb_val = dsai::material_vf;
-	const auto dumb_pri = dsai::uniform_pf;
+	const auto dumb_pri = dsai::forcing_pf;
 
 	AnalysedPosition apos(Position::std_start());
-	auto engine = make_unique<TreeEngine>(apos, dumb_val, dumb_pri, 0.5);
+	auto engine = make_unique<TreeEngine>(apos, dumb_val, dumb_pri, 0.5, 3, *threads);
+	XboardClock clock(20000ms);
 	while (true) {
 		//cerr << engine.apos();
 		string input;
@@ -32,14 +40,16 @@ int main() {
 		}
 		if (input == "go") {
 			//cerr << "GO ACKNOWLEDGED" << endl;
-			this_thread::sleep_for(20000ms);
 			//cerr << engine->display();
-			Move to_make = engine->choose_move();
+			Move to_make = engine->search_until(clock.limits());
+			clock.move_played();
 			cerr << engine->display();
 			cout << "move " << to_make.to_xboard() << endl;
 			if(!engine->advance_by(to_make)) cerr << "ERROR: Could not advance position after move" << endl;
 		}
 		
+		clock.command(input); //level, st and time
+		
 		stringstream ss(input);
 		string word1;
 		ss >> word1;
@@ -48,8 +58,12 @@ int main() {
 			getline(ss, fen);
 			fen.erase(fen.begin());
 			//cerr << "FEN: " << fen << endl;
-			if (!engine->advance_to(fen)) {
-				engine.reset(new TreeEngine(AnalysedPosition(Position(fen)), dumb_val, dumb_pri, 0.2));
+			Position::FenError error;
+			const optional<Position> pos = Position::from_fen(fen, &error);
+			if (!pos) cerr << "ERROR: invalid FEN (" << error.reason << " at offset " << error.offset << ")" << endl;
+			else if (!engine->advance_to(*pos)) {
+				engine.reset(); //the old threads are stopped before the new ones start
+				engine.reset(new TreeEngine(AnalysedPosition(*pos), dumb_val, dumb_pri, 0.2, 3, *threads));
 				cerr << "ENGINE RESET: position not recognised" << endl;
 			}
 		}